@@ -0,0 +1,275 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Transport manifest of the extra backends (SNAP_BACKENDS). Vendor
+ *  backends like hp run on every hotplug event, whichever subsystem it
+ *  came from, unless BackendTransports in the configuration names the
+ *  transports they serve. The transports each backend reported so far are
+ *  learned from its URIs (usb://, socket://, hp:/usb/..., hp:/net/...) and
+ *  kept in $SNAP_COMMON/tmp/backend-transports, as a guide for writing
+ *  BackendTransports. They do not filter the backends: having reported
+ *  only network printers so far does not mean a backend cannot find the
+ *  USB printer plugged in next.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#include "server.h"
+#include "backends.h"
+
+#define MAX_BACKENDS 64
+
+typedef struct {
+  char name[32];
+  int learned,          /* Transports seen in its URIs */
+      configured;       /* BackendTransports, -1 if not set */
+} backend_transports_t;
+
+static backend_transports_t manifest[MAX_BACKENDS];
+static int num_backends = 0, loaded = 0, dirty = 0;
+
+static const struct {
+  const char *name;
+  int transport;
+} transport_names[] = {
+  {"network", TRANSPORT_NETWORK},
+  {"dnssd", TRANSPORT_NETWORK},
+  {"usb", TRANSPORT_USB},
+  {"serial", TRANSPORT_SERIAL},
+  {"parallel", TRANSPORT_PARALLEL},
+  {NULL, 0}
+};
+
+/* URI schemes and first path segments (hp:/usb/...) of each transport */
+static const struct {
+  const char *prefix;
+  int transport;
+} uri_transports[] = {
+  {"usb", TRANSPORT_USB},
+  {"serial", TRANSPORT_SERIAL},
+  {"parallel", TRANSPORT_PARALLEL},
+  {"par", TRANSPORT_PARALLEL},
+  {"net", TRANSPORT_NETWORK},
+  {"socket", TRANSPORT_NETWORK},
+  {"ipp", TRANSPORT_NETWORK},
+  {"ipps", TRANSPORT_NETWORK},
+  {"http", TRANSPORT_NETWORK},
+  {"https", TRANSPORT_NETWORK},
+  {"lpd", TRANSPORT_NETWORK},
+  {"dnssd", TRANSPORT_NETWORK},
+  {"smb", TRANSPORT_NETWORK},
+  {"snmp", TRANSPORT_NETWORK},
+  {NULL, 0}
+};
+
+/*
+ * find_backend() - Manifest entry of name, added if create is set.
+ * Returns NULL if there is none (or no room for it).
+ */
+static backend_transports_t *find_backend(const char *name, int create) {
+  int i;
+
+  for (i = 0; i < num_backends; i++)
+    if (!strcmp(manifest[i].name, name))
+      return manifest + i;
+  if (!create || num_backends >= MAX_BACKENDS ||
+      strlen(name) >= sizeof(manifest[0].name))
+    return NULL;
+  strlcpy(manifest[num_backends].name, name, sizeof(manifest[0].name));
+  manifest[num_backends].learned = 0;
+  manifest[num_backends].configured = -1;
+  return manifest + num_backends++;
+}
+
+/*
+ * parse_transports() - Transport bits of a list like "usb+network".
+ */
+static int parse_transports(const char *list) {
+  const char *end;
+  size_t len;
+  int i, transports = 0;
+
+  for (; *list; list = *end ? end + 1 : end) {
+    if ((end = strchr(list, '+')) == NULL)
+      end = list + strlen(list);
+    len = end - list;
+    for (i = 0; transport_names[i].name; i++)
+      if (strlen(transport_names[i].name) == len &&
+	  !strncasecmp(transport_names[i].name, list, len))
+	break;
+    if (transport_names[i].name)
+      transports |= transport_names[i].transport;
+    else
+      debug_printf("ERROR: Unknown transport \"%.*s\"\n", (int)len, list);
+  }
+  return transports;
+}
+
+/*
+ * format_transports() - Inverse of parse_transports().
+ */
+static void format_transports(int transports, char *buf, size_t len) {
+  int i;
+
+  *buf = '\0';
+  for (i = 0; transport_names[i].name; i++)
+    if ((transports & transport_names[i].transport) &&
+	strcmp(transport_names[i].name, "dnssd")) {
+      if (*buf)
+	strlcat(buf, "+", len);
+      strlcat(buf, transport_names[i].name, len);
+    }
+}
+
+/*
+ * uri_transport() - Transport of a device URI, 0 if unknown.
+ */
+static int uri_transport(const char *uri) {
+  const char *colon = strchr(uri, ':'), *path;
+  size_t len;
+  int i;
+
+  if (colon == NULL)
+    return 0;
+  for (i = 0; uri_transports[i].prefix; i++)
+    if (strlen(uri_transports[i].prefix) == colon - uri &&
+	!strncasecmp(uri_transports[i].prefix, uri, colon - uri))
+      return uri_transports[i].transport;
+
+  /* Vendor schemes name the transport in the path: hp:/usb/Model?... */
+  for (path = colon + 1; *path == '/'; path++);
+  len = strcspn(path, "/?");
+  for (i = 0; uri_transports[i].prefix; i++)
+    if (strlen(uri_transports[i].prefix) == len &&
+	!strncasecmp(uri_transports[i].prefix, path, len))
+      return uri_transports[i].transport;
+  return 0;
+}
+
+static void manifest_path(char *path, size_t len) {
+  snprintf(path, len, "%s/backend-transports", tmpdir);
+}
+
+/*
+ * backends_load() - Read the learned transports and apply the
+ * BackendTransports configuration (BACKEND_TRANSPORTS), once.
+ */
+void backends_load(void) {
+  backend_transports_t *entry;
+  cups_file_t *fp;
+  char path[1024], line[256], *value, *list, *p, *next;
+
+  if (loaded)
+    return;
+  loaded = 1;
+
+  manifest_path(path, sizeof(path));
+  if ((fp = cupsFileOpen(path, "r")) != NULL) {
+    while (cupsFileGets(fp, line, sizeof(line)))
+      if ((value = strchr(line, ' ')) != NULL) {
+	*value++ = '\0';
+	if ((entry = find_backend(line, 1)) != NULL)
+	  entry->learned = parse_transports(value);
+      }
+    cupsFileClose(fp);
+  }
+
+  if ((p = getenv("BACKEND_TRANSPORTS")) == NULL || (list = strdup(p)) == NULL)
+    return;
+  for (p = list; p && *p; p = next) {
+    if ((next = strchr(p, ',')) != NULL)
+      *next++ = '\0';
+    if ((value = strchr(p, '=')) == NULL) {
+      debug_printf("ERROR: Bad BackendTransports entry \"%s\"\n", p);
+      continue;
+    }
+    *value++ = '\0';
+    if ((entry = find_backend(p, 1)) != NULL)
+      entry->configured = parse_transports(value);
+  }
+  free(list);
+}
+
+/*
+ * backends_learn() - Note the transport of a device reported by backend.
+ */
+void backends_learn(const char *backend, const char *uri) {
+  backend_transports_t *entry;
+  char name[64];
+  int transport;
+
+  if (!backend || !*backend || !uri || !(transport = uri_transport(uri)))
+    return;
+  backends_load();
+  if ((entry = find_backend(backend, 1)) == NULL ||
+      (entry->learned & transport))
+    return;
+  entry->learned |= transport;
+  dirty = 1;
+  format_transports(transport, name, sizeof(name));
+  debug_printf("DEBUG: Backend %s reports %s devices\n", backend, name);
+}
+
+/*
+ * backends_save() - Write the learned transports if they changed.
+ */
+void backends_save(void) {
+  cups_file_t *fp;
+  char path[1024], temp[1024], transports[64];
+  int i;
+
+  if (!dirty)
+    return;
+  dirty = 0;
+  manifest_path(path, sizeof(path));
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  if ((fp = cupsFileOpen(temp, "w")) == NULL) {
+    debug_printf("ERROR: Unable to write %s: %s\n", temp, strerror(errno));
+    return;
+  }
+  for (i = 0; i < num_backends; i++)
+    if (manifest[i].learned) {
+      format_transports(manifest[i].learned, transports, sizeof(transports));
+      cupsFilePrintf(fp, "%s %s\n", manifest[i].name, transports);
+    }
+  if (cupsFileClose(fp) || rename(temp, path)) {
+    debug_printf("ERROR: Unable to write %s: %s\n", path, strerror(errno));
+    unlink(temp);
+  }
+}
+
+/*
+ * backends_for(int, char*, size_t) - Append the SNAP_BACKENDS which can
+ * report devices of transport to buf, each preceded by a comma. Only
+ * backends whose BackendTransports do not include transport are left
+ * out.
+ * Returns the number of backends appended.
+ */
+int backends_for(int transport, char *buf, size_t len) {
+  backend_transports_t *entry;
+  char *list, *name, *next, *p;
+  int count = 0;
+
+  if ((p = getenv("SNAP_BACKENDS")) == NULL || (list = strdup(p)) == NULL)
+    return 0;
+  backends_load();
+  for (name = list; name && *name; name = next) {
+    if ((next = strchr(name, ',')) != NULL)
+      *next++ = '\0';
+    if ((entry = find_backend(name, 0)) != NULL && entry->configured >= 0 &&
+	!(entry->configured & transport)) {
+      debug_printf("DEBUG2: Skipping backend %s\n", name);
+      continue;
+    }
+    if (strlen(buf) + strlen(name) + 2 > len)
+      break;
+    strlcat(buf, ",", len);
+    strlcat(buf, name, len);
+    count++;
+  }
+  free(list);
+  return count;
+}
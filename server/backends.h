@@ -0,0 +1,31 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Transports (network, usb, serial, parallel) covered by the extra
+ *  backends in SNAP_BACKENDS, so that a hotplug scan only runs the
+ *  backends which can report a device of that transport.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#ifndef PAF_BACKENDS_H
+
+#define PAF_BACKENDS_H 1
+
+#include <stddef.h>
+
+/* Transport bits, 1 << (signal - 1) / 2 of the hotplug signals */
+#define TRANSPORT_NETWORK  1
+#define TRANSPORT_USB      2
+#define TRANSPORT_SERIAL   4
+#define TRANSPORT_PARALLEL 8
+
+void backends_load(void);
+void backends_learn(const char *backend, const char *uri);
+void backends_save(void);
+int backends_for(int transport, char *buf, size_t len);
+
+#endif
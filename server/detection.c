@@ -13,6 +13,7 @@
 #include <libudev.h>
 #include <sys/poll.h>
 #include <assert.h>
+#include <ctype.h>
 #include <time.h>
 #if HAVE_AVAHI
   #include <avahi-client/client.h>
@@ -25,8 +26,10 @@
 #define SUBSYSTEM "usb"
 #define NUM_PROCESS 3
 
-void static send_signal(const char* signal, pid_t ppid, int hardware_index) {
+void static send_signal(const char* signal, pid_t ppid, int hardware_index,
+			struct udev_device *dev) {
   /*union sigval sv;*/
+  hotplug_event_t event;
   int offset = 0;
   if (!strncasecmp(signal, "add", 3))
     offset = 1;
@@ -35,12 +38,149 @@ void static send_signal(const char* signal, pid_t ppid, int hardware_index) {
   hardware_index = 2 * hardware_index + offset;
   /*sv.sival_int = hardware_index;*/
   /*sigqueue(ppid, SIGUSR1, sv);*/
-  pthread_mutex_lock(&signal_lock);
-  /*fprintf(stdout, "Incrmeneting Pending signals!\n");*/
-  /*fprintf(stdout, "%d: %d\n",
-    hardware_index, pending_signals[hardware_index]);*/
-  pending_signals[hardware_index] ++;
-  pthread_mutex_unlock(&signal_lock);
+  memset(&event, 0, sizeof(event));
+  event.signal = hardware_index;
+  event.time = event_now();
+  if (dev) {
+    const char *p;
+    event.seqnum = udev_device_get_seqnum(dev);
+    if ((p = udev_device_get_subsystem(dev)))
+      strlcpy(event.subsystem, p, sizeof(event.subsystem));
+    if ((p = udev_device_get_devnode(dev)))
+      strlcpy(event.devnode, p, sizeof(event.devnode));
+    if ((p = udev_device_get_syspath(dev)))
+      strlcpy(event.syspath, p, sizeof(event.syspath));
+  }
+  event_push(&event);   /* On overflow the main loop rescans the subsystem */
+  event_wakeup();
+}
+
+/*
+ * USB vendors whose printers (mostly multi-function devices) can expose
+ * only vendor-specific interfaces instead of a printer class one.
+ */
+static const char *printer_vendors[] = {
+  "03f0",	/* HP */
+  "043d",	/* Lexmark */
+  "0482",	/* Kyocera */
+  "04a9",	/* Canon */
+  "04b8",	/* Epson */
+  "04e8",	/* Samsung */
+  "04f9",	/* Brother */
+  "0924",	/* Xerox */
+  "0a5f",	/* Zebra */
+  "1504",	/* Bixolon */
+  NULL
+};
+
+/*
+ * id_in_list() - Check a vendor/product ID against a comma separated list
+ * of "vvvv" or "vvvv:pppp" entries (case insensitive).
+ * Returns -
+ * 1 - Listed
+ * 0 - Not listed
+ */
+static int id_in_list(const char *list, const char *vendor,
+		      const char *product) {
+  char id[10];
+  size_t len;
+
+  if (!list || !vendor)
+    return 0;
+  snprintf(id, sizeof(id), "%s:%s", vendor, product ? product : "");
+  while (*list) {
+    while (*list == ',' || isspace(*list & 255))
+      list++;
+    for (len = 0; list[len] && list[len] != ',' && !isspace(list[len] & 255);
+	 len++);
+    if (len == 4 && !strncasecmp(list, vendor, 4))
+      return 1;
+    if (len == 9 && product && !strncasecmp(list, id, 9))
+      return 1;
+    list += len;
+  }
+  return 0;
+}
+
+/*
+ * has_interface_class() - Check udev's ID_USB_INTERFACES property
+ * (":ccsspp:ccsspp:") for an interface of the given class.
+ * Returns -
+ * 1 - Found
+ * 0 - Not found
+ */
+static int has_interface_class(const char *interfaces, const char *class) {
+  const char *p;
+
+  for (p = interfaces; p && (p = strchr(p, ':')) != NULL; p++)
+    if (!strncasecmp(p + 1, class, 2))
+      return 1;
+  return 0;
+}
+
+/*
+ * has_lp_child() - Check whether the usblp driver has created a
+ * usbmisc/lp* node below the USB device.
+ * Returns -
+ * 1 - Found
+ * 0 - Not found
+ */
+static int has_lp_child(struct udev *udev, struct udev_device *dev) {
+  struct udev_enumerate *en;
+  struct udev_list_entry *entry;
+  int found = 0;
+
+  if ((en = udev_enumerate_new(udev)) == NULL)
+    return 0;
+  udev_enumerate_add_match_parent(en, dev);
+  udev_enumerate_add_match_subsystem(en, "usbmisc");
+  udev_enumerate_add_match_sysname(en, "lp*");
+  if (!udev_enumerate_scan_devices(en))
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(en))
+      found = 1;
+  udev_enumerate_unref(en);
+  return found;
+}
+
+/*
+ * is_printer_event() - Decide in the monitor thread whether an event of
+ * monitor i can concern a printer at all, so that keyboards, disks,
+ * consoles etc. do not cause a backend scan. Config allow/deny lists of
+ * vendor[:product] IDs (UsbAllowList, UsbDenyList) take precedence.
+ * Unknown devices are let through.
+ * Returns -
+ * 1 - Possibly a printer
+ * 0 - Not a printer
+ */
+static int is_printer_event(struct udev *udev, int i,
+			    struct udev_device *dev) {
+  const char *vendor = udev_device_get_property_value(dev, "ID_VENDOR_ID");
+  const char *product = udev_device_get_property_value(dev, "ID_MODEL_ID");
+  const char *interfaces, *syspath;
+
+  if (id_in_list(getenv("USB_DENY_LIST"), vendor, product))
+    return 0;
+  if (id_in_list(getenv("USB_ALLOW_LIST"), vendor, product))
+    return 1;
+
+  switch (i) {
+  case 0:	/* usb */
+    interfaces = udev_device_get_property_value(dev, "ID_USB_INTERFACES");
+    if (!interfaces || has_interface_class(interfaces, "07"))
+      return 1;
+    if (has_lp_child(udev, dev))
+      return 1;
+    if (vendor && has_interface_class(interfaces, "ff"))
+      for (int j = 0; printer_vendors[j]; j++)
+	if (!strcasecmp(vendor, printer_vendors[j]))
+	  return 1;
+    return 0;
+  case 1:	/* tty: virtual consoles are no serial ports */
+    syspath = udev_device_get_syspath(dev);
+    return (!syspath || !strstr(syspath, "/virtual/"));
+  default:
+    return 1;
+  }
 }
 
 int monitor_devices(pid_t ppid){
@@ -57,7 +197,9 @@ int monitor_devices(pid_t ppid){
 
   for (int i = 0; i < NUM_PROCESS; i++) {
     mon[i] = udev_monitor_new_from_netlink(udev, "udev");
-    udev_monitor_filter_add_match_subsystem_devtype(mon[i], arr[i], NULL);
+    /* For usb only whole devices, not each of their interfaces */
+    udev_monitor_filter_add_match_subsystem_devtype(mon[i], arr[i],
+						    i == 0 ? "usb_device" : NULL);
     /*
      *  The thing is, for parallel we will have to monitor multple subsystems.
      *  [parallel, printer, lp]
@@ -81,9 +223,13 @@ int monitor_devices(pid_t ppid){
 	  const char *devnode;
 	  if (devnode = udev_device_get_devnode(dev)) {
 	    const char *action = udev_device_get_action(dev);
-	    if (!strncasecmp(action, "add", 3) ||
-		!strncasecmp(action, "remove", 6))
-	      send_signal(action, ppid, i+1);
+	    if ((!strncasecmp(action, "add", 3) ||
+		 !strncasecmp(action, "remove", 6)) &&
+		is_printer_event(udev, i, dev))
+	      send_signal(action, ppid, i+1, dev);
+	    else
+	      debug_printf("DEBUG2: Ignoring %s event of %s\n", action,
+			   devnode);
 #if 0
 	    const char *devpath = udev_device_get_devpath(dev);
 	    const char *devtype = udev_device_get_devtype(dev);
@@ -122,7 +268,7 @@ static void resolve_callback(AvahiServiceResolver *r,
   assert(r);
   switch(event) {
   case AVAHI_RESOLVER_FOUND:
-    send_signal("add", ppid, 0);
+    send_signal("add", ppid, 0, NULL);
   }
   avahi_service_resolver_free(r);
 }
@@ -150,7 +296,7 @@ static void browse_callback(AvahiServiceBrowser *b,
 			       resolve_callback, c);
     break;
   case AVAHI_BROWSER_REMOVE:
-    send_signal("remove", ppid, 0);
+    send_signal("remove", ppid, 0, NULL);
     break;
   }
 }
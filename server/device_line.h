@@ -0,0 +1,60 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Tokenizer for the device lines reported by the backends (and passed on
+ *  by deviced):
+ *
+ *    class URI "make model" "info" ["1284 device ID"] ["location"]
+ *
+ *  and for the binary device records deviced writes with -b: a 2 byte
+ *  payload length followed by the fields as tag (1 byte), length (2 bytes)
+ *  and value, integers in network byte order. String values include their
+ *  terminating nul so that they can be used in place.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#ifndef PAF_DEVICE_LINE_H
+
+#define PAF_DEVICE_LINE_H 1
+
+#include <stddef.h>
+
+enum device_field {
+  DEVICE_CLASS,
+  DEVICE_URI,
+  DEVICE_MAKE_MODEL,
+  DEVICE_INFO,
+  DEVICE_ID,
+  DEVICE_LOCATION,
+  DEVICE_BACKEND,       /* Records only */
+  DEVICE_NUM_FIELDS
+};
+
+#define DEVICE_TAG_LATENCY 0x80  /* Record tag of the latency, 4 bytes */
+#define DEVICE_RECORD_MAX 8192   /* Largest record incl. length prefix */
+
+/*
+ * A field points into the parsed line. It is unescaped and nul-terminated
+ * in place, so data can be used as a C string as long as the line lives.
+ * Missing optional fields have data == NULL.
+ */
+typedef struct {
+  char *data;
+  size_t len;
+} device_field_t;
+
+typedef struct {
+  device_field_t field[DEVICE_NUM_FIELDS];
+  int latency;          /* ms from deviced start to the report, or -1 */
+} device_line_t;
+
+int device_line_parse(char *line, device_line_t *dev);
+int device_record_format(const device_line_t *dev, unsigned char *buf,
+			 size_t bufsize);
+int device_record_parse(unsigned char *buf, size_t len, device_line_t *dev);
+
+#endif
@@ -10,36 +10,101 @@
  *  information.
  */
 #include "deviced.h"
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/file.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+
+#define CACHE_REFRESH_TIMEOUT 60  /* Seconds for a background refresh */
+#define REFRESH_KILL_TIMEOUT 5    /* Seconds from SIGTERM to SIGKILL */
+#define SIGNAL_EVENT UINT32_MAX   /* epoll data of the signalfd */
+#define HISTORY_SIZE 20           /* Completion times kept per backend */
+#define HISTORY_MIN 5             /* Samples needed for a timeout */
+#define TIMEOUT_FACTOR 1.5        /* Backend timeout = p99 * factor + slack */
+#define TIMEOUT_SLACK 500         /* ms */
 
-#define MAX_BACKENDS 200
+typedef struct {
+  char name[256];
+  int count;                /* Valid entries of ms */
+  int next;                 /* Ring buffer position */
+  int ms[HISTORY_SIZE];     /* Completion times in ms */
+} history_t;
+
+typedef struct {
+  char name[256];
+  int root;
+  int p99;                  /* ms, INT_MAX if unknown */
+} candidate_t;
 
 typedef struct {
   char *name;
   int pid,status;
   cups_file_t *pipe;
   int count;
+  cups_file_t *cache;       /* New cache file while the backend runs */
+  char *cache_tmp;
+  char buf[2048];           /* Partial line read from the pipe */
+  size_t used;
+  double start;             /* When the backend was started */
+  double deadline;          /* Per-backend timeout from its history */
 } backend_t;
 
 int active_backends,num_backends;
+int open_pipes;             /* Backends whose output is not complete */
 int normal_user = 1;
-int dead_children = 1;
-
-static backend_t backends[MAX_BACKENDS];
-static struct pollfd backend_fds[MAX_BACKENDS];
-static void sigchld_handler(int sig, siginfo_t *siginfo, void*context);
+int binary_records = 0;     /* -b: write device records, not lines */
+int refresh_caches = 0;     /* -r: do not answer from the cache */
+int device_limit = -1;      /* Stop after this many devices */
+int num_devices = 0;
+int stop_scan = 0;          /* Limit reached or all wanted devices found */
+static char **wanted = NULL; /* -w: URIs/serial numbers to stop at */
+static int num_wanted = 0;
+static int wanted_left = 0;
+double start_time;
+static char cache_dir[1024];
+
+static backend_t *backends = NULL;  /* Grows with num_backends */
+static int alloc_backends = 0;
+static history_t *history = NULL;   /* Completion times of the backends */
+static int num_history = 0;
+static const char *bound_name = NULL; /* Backend which finished last */
+static double bound_time = 0.0;
+static int bound_timeout = 0;
+static int epoll_fd = -1;
 static double get_current_time(void);
 static int get_device(backend_t *backend);
 static int start_backend(const char* filename, int root);
+static void emit_device(const char *name, char *line);
+static int cache_ttl(const char *name);
+static int cached_backend(const char *name, int root);
+static void reap_backends(int sfd);
+static void finish_backend(backend_t *backend, int complete);
+static void check_wanted(const device_line_t *dev);
+static void load_history(void);
+static void save_history(void);
+static void history_add(const char *name, int ms);
+static int history_p99(const char *name);
+static int compare_candidates(const void *a, const void *b);
 
-static int signal_listeners() {
-  struct sigaction act;
-  memset(&act, '\0', sizeof(act));
-  act.sa_sigaction = &sigchld_handler;
-  act.sa_flags = SA_SIGINFO;
-  if (sigaction(SIGCHLD, &act, NULL) < 0) {
-    fprintf(stderr, "ERROR: Unable to start SIGCHLD Handler!\n");
-    exit(1);
+/*
+ * backend_listed() - Check whether a backend file name starts with one of
+ * the comma separated names in list.
+ */
+static int backend_listed(const char *list, const char *filename) {
+  size_t len;
+
+  while (*list) {
+    len = strcspn(list, ",");
+    if (len && !strncasecmp(list, filename, len))
+      return 1;
+    list += len;
+    if (*list)
+      list++;
   }
+  return 0;
 }
 
 /*
@@ -49,26 +114,47 @@ static int signal_listeners() {
 
 int main(int argc, char *argv[]) {
   int i,
-      device_limit,
       timeout;
   char *server_bin,
        *snap,
        dirname[1024];
   char includes[4096];    //Include-Exclude String
-  int inc_length = 0,
-      exc_length = 0;
   int isInclude = 1;
-  char inc_backends[MAX_BACKENDS][1024];  //Include Backends
-  char exc_backends[MAX_BACKENDS][1024];  //Exclude Backends
   cups_dir_t *dir;    // FD
   cups_dentry_t *dent;
-  double end_time, current_time;
+  double end_time, current_time, next_time;
+  int opt, sfd, nevents, num_candidates = 0, alloc_candidates = 0;
+  char *wanted_arg = NULL, *p;
+  sigset_t mask;
+  struct epoll_event ev, events[64];
+  candidate_t *candidates = NULL, *c;
+
+  start_time = get_current_time();
+  while ((opt = getopt(argc, argv, "+brw:")) != -1)
+    switch (opt) {
+    case 'w':
+      wanted_arg = strdup(optarg);
+      break;
+    case 'b':
+      binary_records = 1;
+      break;
+    case 'r':
+      refresh_caches = 1;
+      break;
+    default:
+      argc = 0;   /* Print usage */
+    }
+  argc -= optind - 1;
+  argv += optind - 1;
+
   if (argc < 4 || argc > 4) {
     fprintf(stderr,
-	    "Usage: %s limit timeout include/exclude\n"
+	    "Usage: deviced [-b] [-r] [-w uri/serial,...] limit timeout include/exclude\n"
 	    "For the include-exclude string, first character can be +(include) or -(exclude).\n"
-	    "If include mode is used only mentioned backends are used and in exclude mode only mentioned backends are ignored.\n",
-	    argv[0]);
+	    "If include mode is used only mentioned backends are used and in exclude mode only mentioned backends are ignored.\n"
+	    "With -b devices are written as binary records (see device_line.h) carrying the backend name and discovery latency.\n"
+	    "Backends with a TTL in DEVICED_CACHE_TTL (e.g. \"snmp=300,dnssd=60\") answer from their last results; -r runs them anyway.\n"
+	    "With -w the scan stops as soon as devices with all the given URIs or serial numbers were reported.\n");
     return 0;
   }
   device_limit = atoi(argv[1]);
@@ -82,7 +168,35 @@ int main(int argc, char *argv[]) {
     timeout = DEFAULT_TIMEOUT_LIMIT;
   if (device_limit < 1)
     device_limit = -1;
-  signal_listeners();
+  if (wanted_arg) {
+    for (num_wanted = 1, p = wanted_arg; (p = strchr(p, ',')) != NULL;
+	 p++)
+      num_wanted++;
+    wanted = calloc(num_wanted, sizeof(char *));
+    for (i = 0, p = strtok(wanted_arg, ","); p && wanted;
+	 p = strtok(NULL, ","))
+      wanted[i++] = p;
+    wanted_left = num_wanted = wanted ? i : 0;
+  }
+
+  /*
+   * Child exits and backend output are both events of one epoll loop.
+   * SIGCHLD is blocked and read from a signalfd; backends get the mask
+   * reset in cupsdPipeCommand().
+   */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0 ||
+      (sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+      (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    fprintf(stderr, "ERROR: [deviced] Unable to set up event loop: %s\n",
+	    strerror(errno));
+    exit(1);
+  }
+  ev.events = EPOLLIN;
+  ev.data.u32 = SIGNAL_EVENT;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sfd, &ev);
+
   if ((server_bin=getenv("CUPS_SERVERBIN")) == NULL) {
     if ((snap = getenv("SNAP"))) {
       server_bin = malloc(sizeof(char) * 4096);
@@ -91,44 +205,22 @@ int main(int argc, char *argv[]) {
       server_bin = DEFAULT_SERVERBIN;
   }
 
+  if ((snap = getenv("SNAP_COMMON")) != NULL)
+    snprintf(cache_dir, sizeof(cache_dir), "%s/tmp/deviced", snap);
+  else
+    snprintf(cache_dir, sizeof(cache_dir), "%s/deviced",
+	     getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+  mkdir(cache_dir, 0700);
+  load_history();
+
   snprintf(dirname, sizeof(dirname), "%s/backend", server_bin);
   if ((dir = cupsDirOpen(dirname)) == NULL) {
     fprintf(stderr, "ERROR: Unable to open backend"
 	    "directory(%s): %s\n", dirname, strerror(errno));
     exit(1);
   }
-  if (strlen(includes)) {
-    if (includes[0] == '-')
-      isInclude = 0;
-    int k = 0;
-    char *cj = includes + 1;
-    for (; *cj; cj++) {
-      if (*cj == ',') {
-        if (k == 0) continue;
-        if (isInclude) {
-          inc_backends[inc_length][k++] = 0;
-          inc_length++;
-        } else {
-          exc_backends[exc_length][k++] = 0;
-          exc_length++;
-        }
-        k = 0;
-      } else {
-        if (isInclude)
-	  inc_backends[inc_length][k++] = *cj;
-        else
-	  exc_backends[exc_length][k++] = *cj;
-      }
-    }
-    if (k)
-      if (isInclude) {
-	inc_backends[inc_length][k++] = 0;
-	inc_length++;
-      } else {
-	exc_backends[exc_length][k++] = 0;
-	exc_length++;
-      }
-  }
+  if (includes[0] == '-')
+    isInclude = 0;
   while ((dent = cupsDirRead(dir)) != NULL) {
     if (!S_ISREG(dent->fileinfo.st_mode) ||
         !isalnum(dent->filename[0] & 255) ||
@@ -136,43 +228,83 @@ int main(int argc, char *argv[]) {
       continue;
 
     int invalid = 0;
-    if (inc_length) {
-      invalid = 1;
-      for (int i = 0; i < inc_length; i++) {
-        if(!strncasecmp(inc_backends[i], dent->filename,
-			strlen(inc_backends[i])))
-          invalid = 0;
-      }
-    } else {
-      for (int i = 0; i < exc_length; i++) {
-        if (!strncasecmp(exc_backends[i], dent->filename,
-			 strlen(exc_backends[i])))
-          invalid = 1;
-      }
+    if (includes[0] == '+' || includes[0] == '-')
+      invalid = (isInclude != backend_listed(includes + 1, dent->filename));
+    if (invalid)
+      continue;
+    if (num_candidates >= alloc_candidates) {
+      alloc_candidates = alloc_candidates ? 2 * alloc_candidates : 32;
+      if ((c = realloc(candidates,
+		       alloc_candidates * sizeof(candidate_t))) == NULL)
+	break;
+      candidates = c;
     }
-    if(!invalid)
-      start_backend(dent->filename,
-		    !(dent->fileinfo.st_mode & (S_IWGRP | S_IRWXO)));
+    c = candidates + num_candidates++;
+    strlcpy(c->name, dent->filename, sizeof(c->name));
+    c->root = !(dent->fileinfo.st_mode & (S_IWGRP | S_IRWXO));
+    c->p99 = history_p99(c->name);
   }
   cupsDirClose(dir);
 
-  end_time = get_current_time() + timeout;
+  /*
+   * Start the backends which took longest so far first (unknown ones
+   * count as slow), so that they do not start late and bound the scan.
+   */
+  qsort(candidates, num_candidates, sizeof(candidate_t), compare_candidates);
+  for (i = 0, c = candidates; i < num_candidates && !stop_scan; i++, c++)
+    if (!cached_backend(c->name, c->root))
+      start_backend(c->name, c->root);
+  free(candidates);
 
-  while(active_backends>0 && (current_time = get_current_time()) < end_time) {
-    timeout = (int)(1000*(end_time - current_time));
-    if (poll(backend_fds, (nfds_t)num_backends, timeout) > 0) {
-      for (i = 0; i < num_backends; i++)
-        if (backend_fds[i].revents && backends[i].pipe) {
-	  cups_file_t *bpipe = backends[i].pipe;
-					/* Copy of pipe for backend... */
-
-	  while (get_device(backends + i)) {
-	    backend_fds[i].fd = 0;
-	    backend_fds[i].events = 0;
-	  }
-	}
+  end_time = get_current_time() + timeout;
+  for (i = 0; i < num_backends; i++)
+    if (backends[i].deadline > end_time)
+      backends[i].deadline = end_time;
+
+  next_time = end_time;
+  for (i = 0; i < num_backends; i++)
+    if (backends[i].pipe && backends[i].deadline < next_time)
+      next_time = backends[i].deadline;
+
+  while (open_pipes > 0 && !stop_scan &&
+	 (current_time = get_current_time()) < end_time) {
+    if (current_time >= next_time) {
+      /* Give up on backends which take much longer than they used to */
+      next_time = end_time;
+      for (i = 0; i < num_backends; i++) {
+	if (!backends[i].pipe)
+	  continue;
+	if (backends[i].deadline <= current_time) {
+	  fprintf(stderr, "DEBUG: [deviced] Backend %s timed out after %d "
+		  "ms\n", backends[i].name,
+		  (int)(1000 * (current_time - backends[i].start)));
+	  if (backends[i].pid > 0)
+	    kill(backends[i].pid, SIGTERM);
+	  finish_backend(backends + i, 0);
+	} else if (backends[i].deadline < next_time)
+	  next_time = backends[i].deadline;
+      }
+      continue;
     }
+    timeout = (int)(1000*(next_time - current_time)) + 1;
+    if ((nevents = epoll_wait(epoll_fd, events,
+			      sizeof(events) / sizeof(events[0]),
+			      timeout)) < 0 && errno != EINTR)
+      break;
+    for (i = 0; i < nevents; i++)
+      if (events[i].data.u32 == SIGNAL_EVENT)
+	reap_backends(sfd);
+      else if (!stop_scan)
+	get_device(backends + events[i].data.u32);
   }
+  for (i = 0; i < num_backends; i++)
+    if (backends[i].pipe)       /* Timed out or no longer needed */
+      finish_backend(backends + i, stop_scan ? -1 : 0);
+  if (bound_name && !stop_scan)
+    fprintf(stderr, "DEBUG: [deviced] Scan took %d ms, bounded by backend "
+	    "%s%s\n", (int)(1000 * (bound_time - start_time)), bound_name,
+	    bound_timeout ? " (timed out)" : "");
+  save_history();
   signal(SIGQUIT,SIG_IGN);
   kill(-1 * getpid(), SIGQUIT);
   return 0;
@@ -186,41 +318,478 @@ get_current_time(void) {
   return (curtime.tv_sec + 0.000001 * curtime.tv_usec);
 }
 
+/*
+ * emit_device() - Pass a device line of backend name on to our output.
+ */
+static void emit_device(const char *name, char *line) {
+  unsigned char record[DEVICE_RECORD_MAX];
+  char copy[2048];
+  device_line_t dev;
+  int len;
+
+  if (stop_scan)
+    return;
+  if (!binary_records) {
+    fprintf(stdout, "%s\n", line);
+    strlcpy(copy, line, sizeof(copy));
+    if (wanted_left && !device_line_parse(copy, &dev))
+      check_wanted(&dev);
+  } else if (device_line_parse(line, &dev))
+    fprintf(stderr, "ERROR: [deviced] Bad line from \"%s\"\n", name);
+  else {
+    dev.field[DEVICE_BACKEND].data = (char *)name;
+    dev.field[DEVICE_BACKEND].len = strlen(name);
+    dev.latency = (int)(1000 * (get_current_time() - start_time));
+    if ((len = device_record_format(&dev, record, sizeof(record))) < 0)
+      fprintf(stderr, "ERROR: [deviced] Device of \"%s\" too large\n", name);
+    else
+      fwrite(record, 1, len, stdout);
+    check_wanted(&dev);
+  }
+  fflush(stdout);   /* The server handles devices as they come */
+
+  if (device_limit > 0 && ++num_devices >= device_limit && !stop_scan) {
+    fprintf(stderr, "DEBUG: [deviced] Device limit of %d reached\n",
+	    device_limit);
+    stop_scan = 1;
+  }
+}
+
+/*
+ * id_value() - Compare the value of key in an IEEE-1284 device ID with
+ * value.
+ * Returns 1 if equal.
+ */
+static int id_value(const char *device_id, const char *key,
+		    const char *value) {
+  size_t keylen = strlen(key), len = strlen(value);
+  const char *p;
+
+  for (p = device_id; p && *p; p = strchr(p, ';') ? strchr(p, ';') + 1 : NULL) {
+    while (isspace(*p & 255))
+      p++;
+    if (!strncasecmp(p, key, keylen) && p[keylen] == ':' &&
+	!strncmp(p + keylen + 1, value, len) &&
+	(!p[keylen + 1 + len] || p[keylen + 1 + len] == ';'))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * check_wanted() - Tick off the -w entries matching dev, by URI, by the
+ * serial parameter of the URI or by the serial number of the device ID.
+ * Stops the scan once all were seen.
+ */
+static void check_wanted(const device_line_t *dev) {
+  const char *uri = dev->field[DEVICE_URI].data,
+	     *id = dev->field[DEVICE_ID].data, *serial, *w;
+  size_t len;
+  int i;
+
+  if (!wanted_left)
+    return;
+  serial = strstr(uri, "serial=");
+  for (i = 0; i < num_wanted; i++) {
+    if ((w = wanted[i]) == NULL)
+      continue;                 /* Already seen */
+    len = strlen(w);
+    if (!strcasecmp(uri, w) ||
+	(serial && !strncmp(serial + 7, w, len) &&
+	 (!serial[7 + len] || serial[7 + len] == '&')) ||
+	(id && (id_value(id, "SN", w) || id_value(id, "SERIALNUMBER", w)))) {
+      fprintf(stderr, "DEBUG: [deviced] Found wanted device %s\n", w);
+      wanted[i] = NULL;
+      if (--wanted_left == 0)
+	stop_scan = 1;
+    }
+  }
+}
+
+/*
+ * backend_line() - Handle a complete output line of backend.
+ */
+static void backend_line(backend_t *backend, char *line) {
+  if (backend->cache)
+    cupsFilePrintf(backend->cache, "%s\n", line);
+  emit_device(backend->name, line);
+  backend->count++;
+}
+
+/*
+ * get_device() - Read what is available on the pipe of backend without
+ * blocking and handle the complete lines.
+ * Returns -
+ * 0 - End of output
+ * 1 - More output may follow
+ */
 static int get_device(backend_t *backend) {
-  char line[2048];
+  char *line, *eol;
+  ssize_t bytes;
 
-  if (cupsFileGets(backend->pipe, line, sizeof(line))) {
-    fprintf(stdout, "%s\n", line);
+  if (!backend->pipe)
+    return 0;
+  while ((bytes = read(cupsFileNumber(backend->pipe),
+		       backend->buf + backend->used,
+		       sizeof(backend->buf) - 1 - backend->used)) > 0) {
+    backend->used += bytes;
+    backend->buf[backend->used] = '\0';
+    for (line = backend->buf; (eol = strchr(line, '\n')) != NULL;
+	 line = eol + 1) {
+      *eol = '\0';
+      backend_line(backend, line);
+    }
+    backend->used -= line - backend->buf;
+    memmove(backend->buf, line, backend->used);
+    if (backend->used == sizeof(backend->buf) - 1) {
+      backend->buf[backend->used] = '\0';  /* Overlong, cut it */
+      backend_line(backend, backend->buf);
+      backend->used = 0;
+    }
+  }
+  if (bytes < 0 && (errno == EAGAIN || errno == EINTR))
     return 1;
+
+  if (backend->used) {          /* Last line without newline */
+    backend->buf[backend->used] = '\0';
+    backend_line(backend, backend->buf);
+    backend->used = 0;
   }
+  finish_backend(backend, 1);
+  return 0;
+}
+
+/*
+ * finish_backend() - Stop reading from backend, whose output is complete
+ * (complete > 0), which timed out (0) or which is no longer needed (< 0),
+ * and record how long it took.
+ */
+static void finish_backend(backend_t *backend, int complete) {
+  char cache[1024];
+  double now = get_current_time();
+
+  /*
+   * Unregister before closing: the registration lives as long as the open
+   * file does, and a refresh child may have a copy of the descriptor.
+   */
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cupsFileNumber(backend->pipe), NULL);
   cupsFileClose(backend->pipe);
   backend->pipe = NULL;
+  open_pipes --;
+  if (backend->cache) {
+    cupsFileClose(backend->cache);
+    backend->cache = NULL;
+    snprintf(cache, sizeof(cache), "%s/%s.cache", cache_dir, backend->name);
+    if (complete <= 0 || rename(backend->cache_tmp, cache))
+      unlink(backend->cache_tmp);
+  }
+
+  if (complete < 0)
+    return;                     /* Says nothing about its latency */
+  history_add(backend->name, (int)(1000 * (now - backend->start)));
+  if (now >= bound_time) {
+    bound_name = backend->name;
+    bound_time = now;
+    bound_timeout = !complete;
+  }
+}
+
+/*
+ * history_find() - History of backend name, added if create is set.
+ * Returns NULL if there is none.
+ */
+static history_t *history_find(const char *name, int create) {
+  history_t *h;
+  int i;
+
+  for (i = 0; i < num_history; i++)
+    if (!strcmp(history[i].name, name))
+      return history + i;
+  if (!create ||
+      (h = realloc(history, (num_history + 1) * sizeof(history_t))) == NULL)
+    return NULL;
+  history = h;
+  h = history + num_history++;
+  memset(h, 0, sizeof(history_t));
+  strlcpy(h->name, name, sizeof(h->name));
+  return h;
+}
+
+/*
+ * history_add() - Record a completion time of backend name. Timed out
+ * runs count with the time they were given, which lets the timeout grow
+ * by TIMEOUT_FACTOR per run if a backend has become slower for good.
+ */
+static void history_add(const char *name, int ms) {
+  history_t *h = history_find(name, 1);
+
+  if (h == NULL)
+    return;
+  h->ms[h->next] = ms;
+  h->next = (h->next + 1) % HISTORY_SIZE;
+  if (h->count < HISTORY_SIZE)
+    h->count++;
+}
+
+static int compare_ints(const void *a, const void *b) {
+  return (*(const int *)a - *(const int *)b);
+}
+
+/*
+ * history_p99() - 99th percentile of the completion times of backend
+ * name (with HISTORY_SIZE samples simply the slowest run).
+ * Returns INT_MAX if there are fewer than HISTORY_MIN samples.
+ */
+static int history_p99(const char *name) {
+  history_t *h = history_find(name, 0);
+  int ms[HISTORY_SIZE];
+
+  if (h == NULL || h->count < HISTORY_MIN)
+    return INT_MAX;
+  memcpy(ms, h->ms, h->count * sizeof(int));
+  qsort(ms, h->count, sizeof(int), compare_ints);
+  return ms[(99 * h->count + 99) / 100 - 1];
+}
+
+static int compare_candidates(const void *a, const void *b) {
+  const candidate_t *ca = a, *cb = b;
+
+  if (ca->p99 != cb->p99)
+    return (ca->p99 < cb->p99 ? 1 : -1);
+  return strcmp(ca->name, cb->name);
+}
+
+/*
+ * load_history() - Read the completion times of earlier scans from the
+ * cache directory, one line "name ms ms ..." per backend.
+ */
+static void load_history(void) {
+  char path[1024], line[2048], *ptr, *end;
+  cups_file_t *fp;
+  history_t *h;
+  long ms;
+
+  snprintf(path, sizeof(path), "%s/latency", cache_dir);
+  if ((fp = cupsFileOpen(path, "r")) == NULL)
+    return;
+  while (cupsFileGets(fp, line, sizeof(line))) {
+    if ((ptr = strchr(line, ' ')) == NULL)
+      continue;
+    *ptr++ = '\0';
+    if ((h = history_find(line, 1)) == NULL)
+      break;
+    while ((ms = strtol(ptr, &end, 10)) >= 0 && end > ptr) {
+      history_add(h->name, (int)ms);
+      ptr = end;
+    }
+  }
+  cupsFileClose(fp);
+}
+
+/*
+ * save_history() - Write the completion times back, oldest first.
+ */
+static void save_history(void) {
+  char path[1024], tmp[1024];
+  cups_file_t *fp;
+  history_t *h;
+  int i, j;
+
+  snprintf(path, sizeof(path), "%s/latency", cache_dir);
+  snprintf(tmp, sizeof(tmp), "%s/latency.%d", cache_dir, (int)getpid());
+  if ((fp = cupsFileOpen(tmp, "w")) == NULL)
+    return;
+  for (i = 0, h = history; i < num_history; i++, h++) {
+    if (!h->count)
+      continue;
+    cupsFilePrintf(fp, "%s", h->name);
+    for (j = h->count; j > 0; j--)
+      cupsFilePrintf(fp, " %d",
+		     h->ms[(h->next - j + HISTORY_SIZE) % HISTORY_SIZE]);
+    cupsFilePrintf(fp, "\n");
+  }
+  cupsFileClose(fp);
+  if (rename(tmp, path))
+    unlink(tmp);
+}
+
+/*
+ * cache_ttl() - Seconds the results of backend name stay valid, from
+ * DEVICED_CACHE_TTL ("name=seconds,...").
+ * Returns 0 if the backend is not cached.
+ */
+static int cache_ttl(const char *name) {
+  const char *p = getenv("DEVICED_CACHE_TTL");
+  size_t len = strlen(name);
+
+  while (p && *p) {
+    if (!strncmp(p, name, len) && p[len] == '=')
+      return atoi(p + len + 1);
+    if ((p = strchr(p, ',')) != NULL)
+      p++;
+  }
   return 0;
 }
 
+/*
+ * backend_path() - Full path of backend name, in CUPS_SERVERBIN, the snap
+ * or the default server bin directory.
+ */
+static void backend_path(char *program, size_t len, const char *name) {
+  const char *server_bin, *snap;
+
+  if ((server_bin = getenv("CUPS_SERVERBIN")) != NULL)
+    snprintf(program, len, "%s/backend/%s", server_bin, name);
+  else if ((snap = getenv("SNAP")) != NULL)
+    snprintf(program, len, "%s/usr/lib/cups/backend/%s", snap, name);
+  else
+    snprintf(program, len, "%s/backend/%s", DEFAULT_SERVERBIN, name);
+}
+
+/*
+ * close_fds() - Close all descriptors but stdin, stdout and stderr.
+ */
+static void close_fds(void) {
+  int fd, max;
+
+#ifdef SYS_close_range
+  if (!syscall(SYS_close_range, 3, ~0U, 0))
+    return;
+#endif
+  for (fd = 3, max = sysconf(_SC_OPEN_MAX); fd < max; fd++)
+    close(fd);
+}
+
+static char refresh_tmp[1024];  /* Output of the running refresh */
+
+/*
+ * refresh_timeout() - SIGALRM handler of a refresh past its deadline:
+ * stop the backend and whatever it started, which share our process
+ * group, and drop the partial output.
+ */
+static void refresh_timeout(int sig) {
+  unlink(refresh_tmp);
+  signal(SIGTERM, SIG_IGN);
+  kill(0, SIGTERM);
+  sleep(REFRESH_KILL_TIMEOUT);
+  kill(0, SIGKILL);             /* Us too, we are done */
+}
+
+/*
+ * refresh_cache() - Rerun backend name in a detached process which writes
+ * its output to the cache, so that the current scan does not wait for it.
+ */
+static void refresh_cache(const char *name, int root) {
+  char program[4096], tmp[1024], cache[1024], line[2048];
+  char *argv[2];
+  cups_file_t *bpipe, *out;
+  int fd, pid, status;
+
+  /*
+   * Leave the process group deviced kills before deviced goes on, then
+   * detach from deviced and its pipes to the server.
+   */
+  if ((pid = fork()) != 0) {
+    if (pid > 0)
+      waitpid(pid, &status, 0);
+    return;
+  }
+  setsid();
+  if (fork())
+    _exit(0);
+  setpgid(0, 0);                /* The group refresh_timeout() kills */
+  if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+    dup2(fd, 0);
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+  }
+  close_fds();                  /* The pipes of the other backends */
+
+  snprintf(tmp, sizeof(tmp), "%s/%s.refresh", cache_dir, name);
+  strlcpy(refresh_tmp, tmp, sizeof(refresh_tmp));
+  snprintf(cache, sizeof(cache), "%s/%s.cache", cache_dir, name);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_CLOEXEC, 0600)) < 0 ||
+      flock(fd, LOCK_EX | LOCK_NB))
+    _exit(0);                   /* Refresh already running */
+  ftruncate(fd, 0);
+  if ((out = cupsFileOpenFd(fd, "w")) == NULL)
+    _exit(1);
+
+  backend_path(program, sizeof(program), name);
+  argv[0] = (char *)name;
+  argv[1] = NULL;
+  signal(SIGALRM, refresh_timeout);
+  alarm(CACHE_REFRESH_TIMEOUT);
+  if ((bpipe = cupsdPipeCommand(&pid, program, argv,
+				root ? 0 : normal_user)) == NULL)
+    _exit(1);
+  while (cupsFileGets(bpipe, line, sizeof(line)))
+    cupsFilePrintf(out, "%s\n", line);
+  cupsFileClose(bpipe);
+  cupsFileFlush(out);
+  if (waitpid(pid, &status, 0) == pid && !status)
+    rename(tmp, cache);
+  else
+    unlink(tmp);
+  _exit(0);
+}
+
+/*
+ * cached_backend() - Answer for backend name from its cache if the cache
+ * is younger than the TTL of the backend. Once half the TTL has passed a
+ * background refresh is started as well. Without a valid cache the
+ * backend is started with its output going to a new cache.
+ * Returns -
+ * 1 - Answered from the cache
+ * 0 - Backend has to be run
+ */
+static int cached_backend(const char *name, int root) {
+  char cache[1024], line[2048];
+  struct stat st;
+  cups_file_t *fp;
+  int ttl = cache_ttl(name);
+  double age;
+
+  if (ttl <= 0)
+    return 0;
+  snprintf(cache, sizeof(cache), "%s/%s.cache", cache_dir, name);
+  if (refresh_caches || stat(cache, &st) ||
+      (age = time(NULL) - st.st_mtime) >= ttl ||
+      (fp = cupsFileOpen(cache, "r")) == NULL)
+    return 0;
+
+  fprintf(stderr, "DEBUG2: [deviced] Results of %s from cache (%d s old)\n",
+	  name, (int)age);
+  while (cupsFileGets(fp, line, sizeof(line)))
+    emit_device(name, line);
+  cupsFileClose(fp);
+  if (age >= ttl / 2)
+    refresh_cache(name, root);
+  return 1;
+}
+
 static int			/* O - 0 on success, -1 on error */
 start_backend(const char *name,	/* I - Backend to run */
               int        root) {/* I - Run as root? */
-  char      *server_bin;	/* CUPS_SERVERBIN environment variable */
-  char      *snap;		/* SNAP environment variable */
   char	    program[4096];	/* Full path to backend */
   backend_t *backend;		/* Current backend */
   char	    *argv[2];		/* Command-line arguments */
 
-  if (num_backends >= MAX_BACKENDS) {
-    fprintf(stderr, "ERROR: Too many backends (%d)!\n", num_backends);
-    return (-1);
-  }
+  struct epoll_event ev;	/* Readiness of the pipe */
+  int       p99;		/* Slowest recent run in ms */
 
-  if ((server_bin=getenv("CUPS_SERVERBIN")) == NULL) {
-    if ((snap=getenv("SNAP"))) {
-      server_bin = malloc(sizeof(char) * 4096);
-      snprintf(server_bin, 4096, "%s/usr/lib/cups/", snap);
-    } else
-      server_bin = DEFAULT_SERVERBIN;
+  if (num_backends >= alloc_backends) {
+    int count = alloc_backends ? 2 * alloc_backends : 32;
+    if ((backend = realloc(backends, count * sizeof(backend_t))) == NULL) {
+      fprintf(stderr, "ERROR: [deviced] Ran out of memory!\n");
+      return (-1);
+    }
+    backends = backend;
+    alloc_backends = count;
   }
 
-  snprintf(program, sizeof(program), "%s/backend/%s", server_bin, name);
+  backend_path(program, sizeof(program), name);
   /*if (_cupsFileCheck(program, _CUPS_FILE_CHECK_PROGRAM, !geteuid(),
                      _cupsFileCheckFilter, NULL))
 		     return (-1);*/
@@ -246,61 +815,86 @@ start_backend(const char *name,	/* I - Backend to run */
   fprintf(stderr, "DEBUG2: [deviced] Started backend %s (PID %d)\n",
           program, backend->pid);
 
-  backend_fds[num_backends].fd     = cupsFileNumber(backend->pipe);
-  backend_fds[num_backends].events = POLLIN;
+  fcntl(cupsFileNumber(backend->pipe), F_SETFL,
+	fcntl(cupsFileNumber(backend->pipe), F_GETFL) | O_NONBLOCK);
+  ev.events = EPOLLIN;
+  ev.data.u32 = num_backends;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cupsFileNumber(backend->pipe),
+		&ev) < 0) {
+    fprintf(stderr, "ERROR: [deviced] Unable to watch backend %s - %s\n",
+	    name, strerror(errno));
+    cupsFileClose(backend->pipe);
+    return (-1);
+  }
 
   backend->name   = strdup(name);
   backend->status = 0;
   backend->count  = 0;
+  backend->cache  = NULL;
+  backend->used   = 0;
+  backend->start  = get_current_time();
+  if ((p99 = history_p99(name)) < INT_MAX)
+    backend->deadline = backend->start +
+			(TIMEOUT_FACTOR * p99 + TIMEOUT_SLACK) / 1000.0;
+  else
+    backend->deadline = HUGE_VAL;     /* Only the global timeout */
+
+  if (cache_ttl(name) > 0) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s/%s.%d", cache_dir, name, (int)getpid());
+    if ((backend->cache = cupsFileOpen(tmp, "w")) != NULL)
+      backend->cache_tmp = strdup(tmp);
+  }
 
   active_backends ++;
+  open_pipes ++;
   num_backends ++;
 
   return (0);
 }
 
-static void sigchld_handler(int sig, siginfo_t *siginfo, void*context) {
+/*
+ * reap_backends() - Drain the signalfd and collect the exit status of all
+ * children which have finished.
+ */
+static void reap_backends(int sfd) {
+  struct signalfd_siginfo info;	/* Queued SIGCHLD, only drained */
   int			i;		/* Looping var */
   int			status;		/* Exit status of child */
   int			pid;		/* Process ID of child */
   backend_t		*backend;	/* Current backend */
-  char			name[4096];	/* Name of process */
+  const char		*name;		/* Name of process */
 
- /*
-  * Reset the dead_children flag...
-  */
-  pid = siginfo->si_pid;
-  dead_children = 0;
+  while (read(sfd, &info, sizeof(info)) == sizeof(info));
 
  /*
-  * Collect the exit status of some children...
+  * Several exits may be merged into one signal, so wait for all of them...
   */
-  status = siginfo->si_status;
-
-  for (i = num_backends, backend = backends; i > 0; i --, backend ++)
-    if (backend->pid == pid)
-      break;
-
-  if (i > 0) {
-    /*name            = backend->name;*/
-    strncpy(name, backend->name, sizeof(name));
-    backend->pid    = 0;
-    backend->status = status;
-    active_backends --;
-  } else
-    strncpy(name, "Unknown", 7);
-
-  if (status) {
-    if (WIFEXITED(status))
-      fprintf(stderr,
-	      "ERROR: [deviced] PID %d (%s) stopped with status %d!\n",
-	      pid, name, WEXITSTATUS(status));
-    else
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (i = num_backends, backend = backends; i > 0; i --, backend ++)
+      if (backend->pid == pid)
+	break;
+
+    if (i > 0) {
+      name            = backend->name;
+      backend->pid    = 0;
+      backend->status = status;
+      active_backends --;
+    } else
+      name = "Unknown";
+
+    if (status) {
+      if (WIFEXITED(status))
+	fprintf(stderr,
+		"ERROR: [deviced] PID %d (%s) stopped with status %d!\n",
+		pid, name, WEXITSTATUS(status));
+      else
+	fprintf(stderr,
+		"ERROR: [deviced] PID %d (%s) crashed on signal %d!\n",
+		pid, name, WTERMSIG(status));
+    } else
       fprintf(stderr,
-	      "ERROR: [deviced] PID %d (%s) crashed on signal %d!\n",
-	      pid, name, WTERMSIG(status));
-  } else
-    fprintf(stderr,
-	    "DEBUG2: [deviced] PID %d (%s) exited with no errors.\n",
-	    pid, name);
+	      "DEBUG2: [deviced] PID %d (%s) exited with no errors.\n",
+	      pid, name);
+  }
 }
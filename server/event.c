@@ -0,0 +1,168 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Wakeup source and hotplug event queue of the server main loop. The
+ *  monitor threads push events and wake the main loop, which drains them.
+ *
+ *  The queue is a bounded lock-free multi-producer queue: every cell
+ *  carries a sequence number telling producers and the consumer whose
+ *  turn it is, so neither side takes a lock.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#include "server.h"
+#include <stdint.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+typedef struct {
+  atomic_size_t sequence;
+  hotplug_event_t event;
+} event_cell_t;
+
+static int wakeup_fd = -1;
+static event_cell_t queue[EVENT_QUEUE_SIZE];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos;    /* Only touched by the main loop */
+static atomic_int overflow[2 * NUM_SIGNALS + 1];
+
+/*
+ * event_init() - Create the eventfd the main loop sleeps on.
+ * Returns -
+ * -1 - Error
+ * 0  - Success
+ */
+int event_init(void) {
+  if (wakeup_fd >= 0)
+    return 0;
+  for (size_t i = 0; i < EVENT_QUEUE_SIZE; i++)
+    atomic_init(&queue[i].sequence, i);
+  atomic_init(&enqueue_pos, 0);
+  dequeue_pos = 0;
+  if ((wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+    debug_printf("ERROR: Unable to create wakeup eventfd: %s\n",
+		 strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * event_wakeup() - Wake up the main loop. Safe to call from any thread.
+ */
+void event_wakeup(void) {
+  uint64_t one = 1;
+
+  if (wakeup_fd < 0)
+    return;
+  if (write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    debug_printf("ERROR: Unable to wake up main loop: %s\n", strerror(errno));
+}
+
+/*
+ * event_wait(int) - Sleep until event_wakeup() is called or timeout
+ * (milliseconds, -1 for no timeout) expires.
+ * Returns -
+ * 1 - Woken up
+ * 0 - Timeout
+ */
+int event_wait(int timeout) {
+  struct pollfd pfd;
+  uint64_t count;
+  int ret;
+
+  if (wakeup_fd < 0) {  /* No eventfd, poll the signals every second */
+    usleep((timeout < 0 || timeout > 1000) ? 1000000 : timeout * 1000);
+    return 0;
+  }
+
+  pfd.fd = wakeup_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  do {
+    ret = poll(&pfd, 1, timeout);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret <= 0)
+    return 0;
+  while (read(wakeup_fd, &count, sizeof(count)) > 0);
+  return 1;
+}
+
+/*
+ * event_now() - Monotonic time in seconds.
+ */
+double event_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec + 0.000000001 * ts.tv_nsec);
+}
+
+/*
+ * event_push(hotplug_event_t*) - Queue an event. Safe to call from any
+ * thread. When the queue is full the event is dropped and its signal is
+ * flagged, see event_overflow().
+ * Returns -
+ * -1 - Queue full
+ * 0  - Success
+ */
+int event_push(hotplug_event_t *event) {
+  event_cell_t *cell;
+  size_t pos, seq;
+  intptr_t diff;
+
+  pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+  for (;;) {
+    cell = queue + (pos & (EVENT_QUEUE_SIZE - 1));
+    seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+						memory_order_relaxed,
+						memory_order_relaxed))
+	break;
+    } else if (diff < 0) {
+      if (event->signal > 0 && event->signal <= 2 * NUM_SIGNALS)
+	atomic_store(&overflow[event->signal], 1);
+      return -1;
+    } else
+      pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+  }
+  cell->event = *event;
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+  return 0;
+}
+
+/*
+ * event_pop(hotplug_event_t*) - Take the oldest event off the queue. Must
+ * only be called from the main loop.
+ * Returns -
+ * 1 - Event copied to *event
+ * 0 - Queue empty
+ */
+int event_pop(hotplug_event_t *event) {
+  event_cell_t *cell = queue + (dequeue_pos & (EVENT_QUEUE_SIZE - 1));
+  size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+
+  if ((intptr_t)seq - (intptr_t)(dequeue_pos + 1) < 0)
+    return 0;
+  *event = cell->event;
+  atomic_store_explicit(&cell->sequence, dequeue_pos + EVENT_QUEUE_SIZE,
+			memory_order_release);
+  dequeue_pos ++;
+  return 1;
+}
+
+/*
+ * event_overflow(int) - Check and clear the overflow flag of a signal.
+ * Returns 1 if events of this signal were dropped since the last call.
+ */
+int event_overflow(int signal) {
+  return atomic_exchange(&overflow[signal], 0);
+}
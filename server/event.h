@@ -0,0 +1,36 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Wakeup source and hotplug event queue of the server main loop. The
+ *  monitor threads push events and wake the main loop, which drains them.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#ifndef PAF_EVENT_H
+
+#define PAF_EVENT_H 1
+
+#define EVENT_QUEUE_SIZE 256  /* Must be a power of two */
+
+typedef struct {
+  int signal;                 /* enum child_signal */
+  unsigned long long seqnum;  /* udev sequence number, 0 for Avahi */
+  double time;                /* event_now() when the event was received */
+  char subsystem[32],         /* udev subsystem */
+       devnode[256],          /* /dev node */
+       syspath[512];          /* sysfs path */
+} hotplug_event_t;
+
+int event_init(void);
+void event_wakeup(void);
+int event_wait(int timeout);
+double event_now(void);
+int event_push(hotplug_event_t *event);
+int event_pop(hotplug_event_t *event);
+int event_overflow(int signal);
+
+#endif
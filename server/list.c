@@ -1,5 +1,6 @@
 #include "server.h"
 #include "list.h"
+#include "ppd_store.h"
 
 int compare_ppd(ppd_t *p0, ppd_t *p1) {
   return strcmp(p0->uri, p1->uri);
@@ -55,19 +56,26 @@ int parsePpdLine(char *line) {
   return res;
 }
 
-int deviceList() {
+/*
+ * deviceList(const char*) - List the devices of all backends. If wanted is
+ * set, deviced stops as soon as a backend reported that URI.
+ */
+int deviceList(const char *wanted) {
   const char  *serverbin;        /* ServerBin */
   char        program[2048];     /* Full Path to program */
-  char        *argv[7];
+  char        *argv[8];
   char        *env[7];
   char        name[32], reques_id[16], limit[16],
               timeout[16], user_id[16], options[1024];
   char        serverdir[1024], serverroot[1024], datadir[1024];
+  const char  *vars[4];
+  char        **envp;
   process_t   *process;
   int         process_pid, status;
   char        includes[4096];
   cups_file_t *errlog;
   char        *p;
+  int         i;
 
   if ((process = calloc(1, sizeof(process_t))) == NULL) {
     debug_printf("ERROR: Ran Out of Memory!\n");
@@ -90,31 +98,42 @@ int deviceList() {
     snprintf(program, sizeof(program), "%s/%s", p, name);
   else
     snprintf(program, sizeof(program), "%s%s/%s", snap, BINDIR, name);
-  snprintf(serverdir, sizeof(serverdir), "%s%s", snap, SERVERBIN);
-  snprintf(serverroot, sizeof(serverroot), "%s/etc/cups", snap);
-  snprintf(datadir, sizeof(datadir), "%s/usr/share/cups", snap);
-
-  setenv("CUPS_SERVERBIN", serverdir, 1);
-  setenv("CUPS_DATADIR", datadir, 1);
-  setenv("CUPS_SERVERROOT", serverroot, 1);
-
-  argv[0] = (char*) name;
-  argv[1] = (char*) limit;
-  argv[2] = (char*) timeout;
-  argv[3] = (char*) includes;
-  argv[4] = NULL;
-
-  if ((process->pipe = cupsdPipeCommand2(&(process->pid), program, argv,
-					 &errlog, 0)) == NULL) {
+  snprintf(serverdir, sizeof(serverdir), "CUPS_SERVERBIN=%s%s", snap,
+	   SERVERBIN);
+  snprintf(serverroot, sizeof(serverroot), "CUPS_SERVERROOT=%s/etc/cups",
+	   snap);
+  snprintf(datadir, sizeof(datadir), "CUPS_DATADIR=%s/usr/share/cups", snap);
+  vars[0] = serverdir;
+  vars[1] = datadir;
+  vars[2] = serverroot;
+  vars[3] = NULL;
+
+  i = 0;
+  argv[i++] = (char*) name;
+  argv[i++] = (char*) "-b";   /* Binary device records */
+  if (wanted) {
+    argv[i++] = (char*) "-w";
+    argv[i++] = (char*) wanted;
+  }
+  argv[i++] = (char*) limit;
+  argv[i++] = (char*) timeout;
+  argv[i++] = (char*) includes;
+  argv[i] = NULL;
+  process->records = 1;
+
+  envp = cupsdSpawnEnv(vars);
+  process->pipe = cupsdPipeCommand2(&(process->pid), program, argv, envp,
+				    &errlog, 0);
+  free(envp);
+  if (process->pipe == NULL) {
     debug_printf("ERROR: Unable to execute deviced!\n");
-    cupsFileClose(errlog);
     free(process);
     return (-1);
   }
   pthread_t logThread;
   logFromFile2(&logThread, errlog);
+  while (!parse_line(process));  /* Before waitpid, the pipe may fill up */
   if ((process_pid = waitpid(process->pid, &status, 0)) > 0) {
-    while (!parse_line(process));
     pthread_join(logThread, NULL);
   } else {
     fprintf(stdout,
@@ -141,7 +160,6 @@ int ppdList() {
   char ppd_name[1024];  /* Full ppd path */
   char escp_model[256];
   char *envp[6];
-  char datadir[1024], serverdir[1024], cachedir[1024];
   char line[4096];
   cups_file_t *errlog;
   process_t *process;
@@ -160,15 +178,8 @@ int ppdList() {
 	   "ppd-make-and-model=\'%s\' ppd-device-id=\'%s\'",
 	   make_and_model, device_id);*/
 
-  snprintf(datadir, sizeof(datadir), "%s%s", snap, DATADIR);
-  snprintf(serverdir, sizeof(serverdir), "%s%s", snap, SERVERBIN);
-  snprintf(cachedir, sizeof(cachedir), "%s", tmpdir);
-
-  setenv("CUPS_DATADIR", datadir, 1);
-  setenv("CUPS_SERVERBIN", serverdir, 1);
-  setenv("CUPS_CACHEDIR", cachedir, 1);
-
-  snprintf(program, sizeof(program), "%s/daemon/%s", serverdir, name);
+  snprintf(program, sizeof(program), "%s%s/daemon/%s", snap, SERVERBIN,
+	   name);
 
   argv[0] = (char*) name;
   argv[1] = (char*) operation;
@@ -178,8 +189,8 @@ int ppdList() {
   argv[5] = NULL;
 
   debug_printf("DEBUG: Executing cups-driverd at %s\n", program);
-  if ((process->pipe = cupsdPipeCommand2(&(process->pid), program,
-					 argv, &errlog, 0)) == NULL) {
+  if ((process->pipe = cupsdPipeCommand2(&(process->pid), program, argv,
+					 driverd_env(), &errlog, 0)) == NULL) {
     debug_printf("ERROR: Unable to execute!\n");
     cupsFileClose(errlog);
     free(process);
@@ -195,7 +206,7 @@ int ppdList() {
 }
 
 int printDevices() {
-  if (deviceList())
+  if (deviceList(NULL))
     return 1;
 
   device_t *dev = cupsArrayFirst(con_devices);
@@ -221,7 +232,6 @@ int getPPDfile(char* ppd_uri, char** ppdfile) {
   process_t* process;
   char name[16], operation[8];
   char program[PATH_MAX];
-  char datadir[1024], serverdir[1024], cachedir[1024];
   cups_file_t *errlog;
   char *argv[6];
   char *filename;
@@ -245,11 +255,8 @@ int getPPDfile(char* ppd_uri, char** ppdfile) {
   if (ppdFD <= 0)
     return -1;
   close(ppdFD);
-  cups_file_t* temp_ppd;
-  if ((temp_ppd = cupsFileOpen(filename, "w")) == NULL) {
-    fprintf(stderr, "ERROR: Unable to open temporary ppdfile.");
-    return -1;
-  }
+  if (!ppd_store_link(ppd_uri, filename))
+    return 0;
 
   if ((process = calloc(1, sizeof(process_t))) == NULL) {
     fprintf(stderr, "ERROR: Ran Out of Memory!\n");
@@ -259,23 +266,16 @@ int getPPDfile(char* ppd_uri, char** ppdfile) {
   strcpy(name, "cups-driverd");
   strcpy(operation, "cat");
 
-  snprintf(datadir, sizeof(datadir), "%s%s", snap, DATADIR);
-  snprintf(serverdir, sizeof(serverdir), "%s%s", snap, SERVERBIN);
-  snprintf(cachedir, sizeof(cachedir), "%s", tmpdir);
-
-  setenv("CUPS_DATADIR", datadir, 1);
-  setenv("CUPS_SERVERBIN", serverdir, 1);
-  setenv("CUPS_CACHEDIR", cachedir, 1);
-
-  snprintf(program, sizeof(program), "%s/daemon/%s", serverdir, name);
+  snprintf(program, sizeof(program), "%s%s/daemon/%s", snap, SERVERBIN,
+	   name);
   
   argv[0] = (char*) name;
   argv[1] = (char*) operation;
   argv[2] = (char*) ppd_uri;
   argv[3] = NULL;
   
-  if ((process->pipe = cupsdPipeCommand2(&(process->pid), program,
-					 argv, &errlog, 0)) == NULL) {
+  if ((process->pipe = cupsdPipeCommand2(&(process->pid), program, argv,
+					 driverd_env(), &errlog, 0)) == NULL) {
     debug_printf("ERROR: Unable to execute cups-driverd!\n");
     free(process);
     cupsFileClose(errlog);
@@ -283,28 +283,25 @@ int getPPDfile(char* ppd_uri, char** ppdfile) {
   }
 
   logFromFile2(&logThread, errlog);
-  int counter = print_ppd(process, temp_ppd);
-  if ((waitpid(process->pid, &status, 0)) > 0) {
-    if(WIFEXITED(status)) {
-      int st = 0;
-      /*counter = ;*/
-      /*while((st = print_ppd(process, tempPPD)) > 0) counter++;*/
-    }
-    pthread_join(logThread, NULL);
-  } else {
-    free(process);
-    cupsFileClose(temp_ppd);
-    return -1;
-  }
+  ssize_t size = save_ppd(process, filename);
+  pid_t pid = waitpid(process->pid, &status, 0);
+  pthread_join(logThread, NULL);
 
-  cupsFileClose(temp_ppd);
   free(process);
+  if (size >= 0 && (pid <= 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))) {
+    unlink(filename);  /* May have been cut short */
+    size = -1;
+  }
+  if (size < 0)
+    return -1;
+  ppd_store_add(ppd_uri, filename);
   return 0;
 }
 
 int verifyDeviceExist(char *device_uri)
 {
-  deviceList();
+  deviceList(device_uri);
   device_t* dev=cupsArrayFirst(con_devices);
   for(;dev;dev=cupsArrayNext(con_devices))
   {
@@ -326,7 +323,10 @@ int attach(char* device_uri, char* ppd_uri,char* name, int port) {
   char program[PATH_MAX];
   char command[PATH_MAX];
   char port_string[8];
-  char datadir[1024], serverdir[1024], cachedir[1024];
+  char datadir[1024], serverdir[1024], cachedir[1024], uri_var[1100],
+       printer_var[1100];
+  const char *vars[6];
+  char **envp;
   char *p;
 
   snprintf(program, sizeof(program), "%s%s/ippeveprinter", snap, SBINDIR);
@@ -346,18 +346,21 @@ int attach(char* device_uri, char* ppd_uri,char* name, int port) {
   argv[7] = (char*) name;
   argv[8] = NULL;
 
-  snprintf(datadir, sizeof(datadir), "%s%s", snap, DATADIR);
-  snprintf(serverdir, sizeof(serverdir), "%s%s", snap, SERVERBIN);
-  snprintf(cachedir, sizeof(cachedir), "%s", tmpdir);
-
-  setenv("CUPS_DATADIR", datadir, 1);
-  setenv("CUPS_SERVERBIN", serverdir, 1);
-  setenv("CUPS_CACHEDIR", cachedir, 1);
-
-  setenv("DEVICE_URI", device_uri, 1);
-  setenv("PRINTER", name, 1);
-
-  execvp(argv[0], argv);
+  snprintf(datadir, sizeof(datadir), "CUPS_DATADIR=%s%s", snap, DATADIR);
+  snprintf(serverdir, sizeof(serverdir), "CUPS_SERVERBIN=%s%s", snap,
+	   SERVERBIN);
+  snprintf(cachedir, sizeof(cachedir), "CUPS_CACHEDIR=%s", tmpdir);
+  snprintf(uri_var, sizeof(uri_var), "DEVICE_URI=%s", device_uri);
+  snprintf(printer_var, sizeof(printer_var), "PRINTER=%s", name);
+  vars[0] = datadir;
+  vars[1] = serverdir;
+  vars[2] = cachedir;
+  vars[3] = uri_var;
+  vars[4] = printer_var;
+  vars[5] = NULL;
+
+  if ((envp = cupsdSpawnEnv(vars)) != NULL)
+    execve(argv[0], argv, envp);
 }
 
 void usage(char *arg) {
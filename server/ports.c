@@ -0,0 +1,250 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  IPP ports of the printers. The ports from PORT_MIN to PORT_MAX are
+ *  handed out from a bitmap of the ports leased to running printers, so
+ *  printers started at the same time never get the same port, and each
+ *  device URI keeps its port across restarts ($SNAP_COMMON/tmp/ports):
+ *  a replugged printer comes back at the URL clients know.
+ *
+ *  A port is checked by binding it. With IPP_SOCKET_ACTIVATION the bound
+ *  socket itself is handed to ippeveprinter (LISTEN_FDS), so no other
+ *  program can take the port between the check and the start; this needs
+ *  an ippeveprinter which accepts a socket-activated listener.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#include "server.h"
+#include "ports.h"
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define PORT_MIN 8000
+#define PORT_MAX 9000        /* Not included */
+#define NUM_PORTS (PORT_MAX - PORT_MIN)
+#define PORT_WORDS ((NUM_PORTS + 63) / 64)
+
+static uint64_t leased[PORT_WORDS];    /* Used by running printers */
+static uint64_t claimed[PORT_WORDS];   /* Remembered for a device URI */
+static char *port_uris[NUM_PORTS];     /* Device URI of claimed ports */
+static int loaded = 0;
+static pthread_mutex_t port_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ports_path(char *path, size_t len) {
+  snprintf(path, len, "%s/ports", tmpdir);
+}
+
+static void set_bit(uint64_t *map, int i) {
+  map[i / 64] |= 1ULL << (i % 64);
+}
+
+static void clear_bit(uint64_t *map, int i) {
+  map[i / 64] &= ~(1ULL << (i % 64));
+}
+
+static int test_bit(const uint64_t *map, int i) {
+  return !!(map[i / 64] & (1ULL << (i % 64)));
+}
+
+/*
+ * port_socket_activation() - Whether ippeveprinter gets its listening
+ * socket from us (IPP_SOCKET_ACTIVATION).
+ */
+int port_socket_activation(void) {
+  const char *p = getenv("IPP_SOCKET_ACTIVATION");
+
+  return (p && (!strcasecmp(p, "yes") || !strcasecmp(p, "on") ||
+		!strcmp(p, "1")));
+}
+
+/*
+ * load_ports() - Read the ports of the device URIs, once.
+ */
+static void load_ports(void) {
+  cups_file_t *fp;
+  char path[1024], line[2048], *uri;
+  int port;
+
+  if (loaded)
+    return;
+  loaded = 1;
+
+  for (int i = NUM_PORTS; i < PORT_WORDS * 64; i++)
+    set_bit(leased, i);           /* Never handed out */
+
+  ports_path(path, sizeof(path));
+  if ((fp = cupsFileOpen(path, "r")) == NULL)
+    return;
+  while (cupsFileGets(fp, line, sizeof(line))) {
+    if ((uri = strchr(line, ' ')) == NULL)
+      continue;
+    *uri++ = '\0';
+    port = atoi(line) - PORT_MIN;
+    if (port < 0 || port >= NUM_PORTS || port_uris[port] ||
+	(port_uris[port] = strdup(uri)) == NULL)
+      continue;
+    set_bit(claimed, port);
+  }
+  cupsFileClose(fp);
+}
+
+/*
+ * save_ports() - Write the ports of the device URIs.
+ */
+static void save_ports(void) {
+  cups_file_t *fp;
+  char path[1024], temp[1024];
+
+  ports_path(path, sizeof(path));
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  if ((fp = cupsFileOpen(temp, "w")) == NULL) {
+    debug_printf("ERROR: Unable to write %s: %s\n", temp, strerror(errno));
+    return;
+  }
+  for (int i = 0; i < NUM_PORTS; i++)
+    if (port_uris[i])
+      cupsFilePrintf(fp, "%d %s\n", PORT_MIN + i, port_uris[i]);
+  if (cupsFileClose(fp) || rename(temp, path)) {
+    debug_printf("ERROR: Unable to write %s: %s\n", path, strerror(errno));
+    unlink(temp);
+  }
+}
+
+/*
+ * bind_port() - Bind port on all addresses, IPv6 and IPv4 if possible.
+ * Returns the socket (listening if listening is set), or -1 if the port
+ * is in use.
+ */
+static int bind_port(int port, int listening) {
+  struct sockaddr_in6 addr6;
+  struct sockaddr_in addr;
+  int fd, on = 1, off = 0;
+
+  memset(&addr6, 0, sizeof(addr6));
+  addr6.sin6_family = AF_INET6;
+  addr6.sin6_addr = in6addr_any;
+  addr6.sin6_port = htons(port);
+  if ((fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    if (bind(fd, (struct sockaddr*)&addr6, sizeof(addr6)))
+      goto fail;
+  } else {                        /* No IPv6 */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+      return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)))
+      goto fail;
+  }
+  if (listening && listen(fd, SOMAXCONN))
+    goto fail;
+  return fd;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+/*
+ * find_port() - First port neither leased nor in skip.
+ * Returns the index of the port, or -1 if there is none.
+ */
+static int find_port(const uint64_t *skip) {
+  uint64_t free_bits;
+
+  for (int w = 0; w < PORT_WORDS; w++)
+    if ((free_bits = ~(leased[w] | skip[w])) != 0)
+      return w * 64 + __builtin_ctzll(free_bits);
+  return -1;
+}
+
+/*
+ * port_lease() - Lease the IPP port of the printer of device_uri: the
+ * port it had before if that is free, else a port no other device had.
+ * If listen_fd is set, it gets the bound, listening socket.
+ * Returns -
+ * -1 - No free port
+ * else The port, for port_release()
+ */
+int port_lease(const char *device_uri, int *listen_fd) {
+  uint64_t busy[PORT_WORDS],    /* Bound by other programs */
+	   skip[PORT_WORDS];
+  int i, fd = -1, pass;
+
+  pthread_mutex_lock(&port_lock);
+  load_ports();
+  memset(busy, 0, sizeof(busy));
+
+  for (i = 0; i < NUM_PORTS; i++)
+    if (port_uris[i] && !strcmp(port_uris[i], device_uri))
+      break;
+  if (i < NUM_PORTS && !test_bit(leased, i) &&
+      (fd = bind_port(PORT_MIN + i, listen_fd != NULL)) < 0) {
+    debug_printf("DEBUG: Port %d is used by another program\n",
+		 PORT_MIN + i);
+    set_bit(busy, i);
+  }
+
+  /* Else a port nobody had, or if all are taken, one of a device not here */
+  for (pass = 0; fd < 0 && pass < 2; pass++) {
+    for (int w = 0; w < PORT_WORDS; w++)
+      skip[w] = busy[w] | (pass ? 0 : claimed[w]);
+    while (fd < 0 && (i = find_port(skip)) >= 0)
+      if ((fd = bind_port(PORT_MIN + i, listen_fd != NULL)) < 0) {
+	debug_printf("DEBUG: Port %d is used by another program\n",
+		     PORT_MIN + i);
+	set_bit(busy, i);
+	set_bit(skip, i);
+      }
+  }
+  if (fd < 0) {
+    pthread_mutex_unlock(&port_lock);
+    debug_printf("ERROR: No free port for %s\n", device_uri);
+    return -1;
+  }
+
+  set_bit(leased, i);
+  if (!port_uris[i] || strcmp(port_uris[i], device_uri)) {
+    if (port_uris[i])
+      debug_printf("DEBUG: Port %d of %s goes to %s\n", PORT_MIN + i,
+		   port_uris[i], device_uri);
+    for (int j = 0; j < NUM_PORTS; j++)
+      if (port_uris[j] && !strcmp(port_uris[j], device_uri)) {
+	free(port_uris[j]);      /* Its old port was taken */
+	port_uris[j] = NULL;
+	clear_bit(claimed, j);
+      }
+    free(port_uris[i]);
+    port_uris[i] = strdup(device_uri);
+    set_bit(claimed, i);
+    save_ports();
+  }
+  pthread_mutex_unlock(&port_lock);
+
+  if (listen_fd)
+    *listen_fd = fd;
+  else
+    close(fd);
+  return PORT_MIN + i;
+}
+
+/*
+ * port_release() - Return the port of a stopped printer. It stays the
+ * port of the device for when it comes back.
+ */
+void port_release(int port) {
+  if (port < PORT_MIN || port >= PORT_MAX)
+    return;
+  pthread_mutex_lock(&port_lock);
+  clear_bit(leased, port - PORT_MIN);
+  pthread_mutex_unlock(&port_lock);
+}
@@ -0,0 +1,20 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  IPP ports of the printers.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#ifndef PAF_PORTS_H
+
+#define PAF_PORTS_H 1
+
+int port_lease(const char *device_uri, int *listen_fd);
+void port_release(int port);
+int port_socket_activation(void);
+
+#endif
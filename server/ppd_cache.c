@@ -0,0 +1,389 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Persistent PPD match cache. Resolving the PPD of a new printer takes
+ *  a "cups-driverd list", which scans the whole driver database, and a
+ *  "cups-driverd cat". The result only depends on the make and model, the
+ *  MFG, MDL and CMD keys of the device ID and the installed drivers, so
+ *  we remember the ppd-URI of each match in $SNAP_COMMON/tmp/ppd/matches
+ *
+ *    stamp <driver stamp>
+ *    <ppd-uri> <make and model><TAB><device ID>
+ *    - <time> <make and model><TAB><device ID>
+ *
+ *  and link the PPD from the store (ppd_store.c) on a hit. "-" lines are
+ *  devices for which cups-driverd found no PPD at <time>; they are not
+ *  asked for again for PPD_NEGATIVE_TTL seconds. The whole cache is
+ *  dropped when the driver stamp (snap revision and mtimes of the driver
+ *  directories) changes.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#include "server.h"
+#include "ppd_cache.h"
+#include "ppd_store.h"
+
+#define NEGATIVE_TTL 86400  /* Default PPD_NEGATIVE_TTL, seconds */
+
+typedef struct {
+  char *key;            /* Normalized make and model, TAB, device ID */
+  char ppd_uri[1024];   /* Empty if there is no PPD */
+  time_t failed;        /* When no PPD was found */
+} ppd_entry_t;
+
+static cups_array_t *entries = NULL;
+static char cache_stamp[1024] = "";
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int compare_entries(ppd_entry_t *a, ppd_entry_t *b, void *data) {
+  return strcmp(a->key, b->key);
+}
+
+static void free_entry(ppd_entry_t *entry, void *data) {
+  free(entry->key);
+  free(entry);
+}
+
+static void cache_path(char *path, size_t len, const char *file) {
+  snprintf(path, len, "%s/ppd/%s", tmpdir, file);
+}
+
+/*
+ * negative_ttl() - Seconds a device without PPD is not looked up again,
+ * from PPD_NEGATIVE_TTL. 0 disables the negative entries.
+ */
+static int negative_ttl(void) {
+  const char *p = getenv("PPD_NEGATIVE_TTL");
+
+  return (p && *p ? atoi(p) : NEGATIVE_TTL);
+}
+
+/*
+ * print_entry() - Write entry as a line of the index.
+ */
+static void print_entry(cups_file_t *fp, ppd_entry_t *entry) {
+  if (entry->ppd_uri[0])
+    cupsFilePrintf(fp, "%s %s\n", entry->ppd_uri, entry->key);
+  else
+    cupsFilePrintf(fp, "- %lld %s\n", (long long)entry->failed, entry->key);
+}
+
+/*
+ * ppd_normalize() - Lowercase in with runs of whitespace (and control
+ * characters) collapsed into single spaces and no spaces at the ends.
+ */
+void ppd_normalize(const char *in, size_t inlen, char *out, size_t len) {
+  const char *end = in + inlen;
+  char *ptr = out;
+  int space = 0;
+
+  for (; in < end && *in && ptr < out + len - 1; in++) {
+    if (isspace(*in & 255) || iscntrl(*in & 255)) {
+      space = ptr > out;
+      continue;
+    }
+    if (space && ptr < out + len - 2)
+      *ptr++ = ' ';
+    space = 0;
+    *ptr++ = tolower(*in & 255);
+  }
+  *ptr = '\0';
+}
+
+/*
+ * ppd_device_id_key() - Normalized value of the MFG, MDL or CMD key (or
+ * their long names) of a device ID.
+ * Returns -
+ * -1 - Not in the device ID
+ * 0 - Success
+ */
+int ppd_device_id_key(const char *device_id, int key, char *out,
+		      size_t len) {
+  static const char *keys[][2] = {
+    {"MFG", "MANUFACTURER"},
+    {"MDL", "MODEL"},
+    {"CMD", "COMMAND SET"}
+  };
+  const char *ptr, *colon, *end;
+
+  *out = '\0';
+  for (ptr = device_id; ptr && *ptr; ptr = end ? end + 1 : NULL) {
+    while (isspace(*ptr & 255))
+      ptr++;
+    end = strchr(ptr, ';');
+    if ((colon = strchr(ptr, ':')) == NULL || (end && colon > end))
+      continue;
+    if ((colon - ptr == strlen(keys[key][0]) &&
+	 !strncasecmp(ptr, keys[key][0], colon - ptr)) ||
+	(colon - ptr == strlen(keys[key][1]) &&
+	 !strncasecmp(ptr, keys[key][1], colon - ptr))) {
+      ppd_normalize(colon + 1, end ? end - colon - 1 : strlen(colon + 1),
+		    out, len);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * normalize_device_id() - The keys of a device ID which decide the PPD
+ * match (MFG, MDL, CMD) as "mfg:...;mdl:...;cmd:...", dropping status,
+ * serial numbers and the like.
+ */
+static void normalize_device_id(const char *device_id, char *out,
+				size_t len) {
+  static const char *names[] = {"mfg", "mdl", "cmd"};
+  char value[1024];
+  int i;
+
+  *out = '\0';
+  for (i = PPD_ID_MFG; i <= PPD_ID_CMD; i++)
+    if (!ppd_device_id_key(device_id, i, value, sizeof(value)))
+      snprintf(out + strlen(out), len - strlen(out), "%s:%s;", names[i],
+	       value);
+}
+
+static void make_key(const char *make_and_model, const char *device_id,
+		     char *key, size_t len) {
+  size_t used;
+
+  ppd_normalize(make_and_model, strlen(make_and_model), key, len - 1);
+  used = strlen(key);
+  key[used++] = '\t';
+  normalize_device_id(device_id ? device_id : "", key + used, len - used);
+}
+
+/*
+ * ppd_driver_stamp() - Describe the installed drivers: the snap revision
+ * and the mtimes of the directories cups-driverd looks at, which change
+ * when PPDs or driver programs are added or removed.
+ */
+void ppd_driver_stamp(char *stamp, size_t len) {
+  const char *root = snap ? snap : "", *rev = getenv("SNAP_REVISION");
+  char dirs[4][1024];
+  struct stat st;
+  int i;
+
+  snprintf(dirs[0], sizeof(dirs[0]), "%s%s/model", root, DATADIR);
+  snprintf(dirs[1], sizeof(dirs[1]), "%s%s/drv", root, DATADIR);
+  snprintf(dirs[2], sizeof(dirs[2]), "%s%s/driver", root, SERVERBIN);
+  snprintf(dirs[3], sizeof(dirs[3]), "%s/usr/share/ppd", root);
+
+  snprintf(stamp, len, "%s", rev ? rev : "-");
+  for (i = 0; i < 4; i++) {
+    if (stat(dirs[i], &st))
+      strlcat(stamp, " -", len);
+    else
+      snprintf(stamp + strlen(stamp), len - strlen(stamp), " %lld.%09ld",
+	       (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+  }
+}
+
+/*
+ * write_index() - Rewrite the index for stamp with the current entries.
+ */
+static void write_index(const char *stamp) {
+  cups_file_t *fp;
+  ppd_entry_t *entry;
+  char path[1024], temp[1024];
+
+  cache_path(path, sizeof(path), "matches");
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  if ((fp = cupsFileOpen(temp, "w")) == NULL) {
+    debug_printf("ERROR: Unable to write %s: %s\n", temp, strerror(errno));
+    return;
+  }
+  cupsFilePrintf(fp, "stamp %s\n", stamp);
+  for (entry = cupsArrayFirst(entries); entry;
+       entry = cupsArrayNext(entries))
+    print_entry(fp, entry);
+  if (cupsFileClose(fp) || rename(temp, path))
+    unlink(temp);
+}
+
+/*
+ * purge_cache() - Drop all matches, the drivers changed.
+ */
+static void purge_cache(const char *stamp) {
+  cupsArrayClear(entries);
+  write_index(stamp);
+}
+
+static ppd_entry_t *add_entry(const char *ppd_uri, time_t failed,
+			      const char *key) {
+  ppd_entry_t *entry, *old;
+
+  if (strlen(ppd_uri) >= sizeof(entry->ppd_uri))
+    return NULL;                /* Not cached rather than cut short */
+  if ((entry = calloc(1, sizeof(ppd_entry_t))) == NULL ||
+      (entry->key = strdup(key)) == NULL) {
+    free(entry);
+    return NULL;
+  }
+  strcpy(entry->ppd_uri, ppd_uri);
+  entry->failed = failed;
+  if ((old = cupsArrayFind(entries, entry)) != NULL)
+    cupsArrayRemove(entries, old);  /* Frees it */
+  cupsArrayAdd(entries, entry);
+  return entry;
+}
+
+/*
+ * load_cache() - Read the index on first use and check the driver stamp.
+ * Returns -1 if the cache cannot be used.
+ */
+static int load_cache(void) {
+  cups_file_t *fp;
+  char path[1024], stamp[1024], line[4096], *key;
+  time_t failed, expired = time(NULL) - negative_ttl();
+  int lines = 0;
+
+  ppd_driver_stamp(stamp, sizeof(stamp));
+  if (entries) {
+    if (strcmp(stamp, cache_stamp)) {
+      debug_printf("DEBUG: Drivers changed, dropping the PPD cache\n");
+      purge_cache(stamp);
+      strlcpy(cache_stamp, stamp, sizeof(cache_stamp));
+    }
+    return 0;
+  }
+
+  if ((entries = cupsArrayNew3((cups_array_func_t)compare_entries, NULL,
+			       NULL, 0, NULL,
+			       (cups_afree_func_t)free_entry)) == NULL)
+    return -1;
+  strlcpy(cache_stamp, stamp, sizeof(cache_stamp));
+  cache_path(path, sizeof(path), "");
+  if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+    debug_printf("ERROR: Cannot create directory %s: %s\n", path,
+		 strerror(errno));
+    return -1;
+  }
+
+  cache_path(path, sizeof(path), "matches");
+  if ((fp = cupsFileOpen(path, "r")) == NULL ||
+      !cupsFileGets(fp, line, sizeof(line)) || strncmp(line, "stamp ", 6) ||
+      strcmp(line + 6, stamp)) {
+    if (fp)
+      cupsFileClose(fp);
+    purge_cache(stamp);
+    return 0;
+  }
+  while (cupsFileGets(fp, line, sizeof(line))) {
+    lines++;
+    if ((key = strchr(line, ' ')) == NULL)
+      continue;
+    *key++ = '\0';
+    if (strcmp(line, "-"))
+      add_entry(line, 0, key);
+    else if ((failed = strtoll(key, &key, 10)) > expired && *key++ == ' ')
+      add_entry("", failed, key);
+  }
+  cupsFileClose(fp);
+  if (lines > 2 * cupsArrayCount(entries) + 16)
+    write_index(stamp);         /* Mostly replaced entries */
+  debug_printf("DEBUG: %d matches in the PPD cache\n",
+	       cupsArrayCount(entries));
+  return 0;
+}
+
+static int cache_get(const char *make_and_model, const char *device_id,
+		     const char *ppd) {
+  ppd_entry_t key, *entry;
+  char keybuf[2048];
+
+  if (load_cache())
+    return -1;
+  make_key(make_and_model, device_id, keybuf, sizeof(keybuf));
+  key.key = keybuf;
+  if ((entry = cupsArrayFind(entries, &key)) == NULL)
+    return -1;
+
+  if (!entry->ppd_uri[0]) {
+    if (time(NULL) - entry->failed < negative_ttl()) {
+      debug_printf("DEBUG: No PPD for %s, cached\n", make_and_model);
+      return 1;
+    }
+    cupsArrayRemove(entries, entry);  /* Expired, ask cups-driverd again */
+    return -1;
+  }
+  if (ppd_store_link(entry->ppd_uri, ppd)) {
+    debug_printf("DEBUG: Cached PPD %s is gone\n", entry->ppd_uri);
+    cupsArrayRemove(entries, entry);
+    return -1;
+  }
+  debug_printf("DEBUG: PPD cache hit, %s\n", entry->ppd_uri);
+  return 0;
+}
+
+/*
+ * ppd_cache_get() - Place the cached PPD of make_and_model and device_id
+ * at the path ppd.
+ * Returns -
+ * -1 - Not cached
+ * 0 - Success
+ * 1 - The device has no PPD, cups-driverd found none lately
+ */
+int ppd_cache_get(const char *make_and_model, const char *device_id,
+		  const char *ppd) {
+  int ret;
+
+  pthread_mutex_lock(&cache_lock);
+  ret = cache_get(make_and_model, device_id, ppd);
+  pthread_mutex_unlock(&cache_lock);
+  return ret;
+}
+
+/*
+ * cache_put() - Add the match (ppd_uri) or the failure (failed) of
+ * make_and_model and device_id to the cache and its index.
+ */
+static void cache_put(const char *make_and_model, const char *device_id,
+		      const char *ppd_uri, time_t failed) {
+  cups_file_t *fp;
+  ppd_entry_t key, *entry;
+  char keybuf[2048], path[1024];
+
+  if (load_cache() || strchr(ppd_uri, ' '))
+    return;
+  make_key(make_and_model, device_id, keybuf, sizeof(keybuf));
+  key.key = keybuf;
+  if (!failed && (entry = cupsArrayFind(entries, &key)) != NULL &&
+      !strcmp(entry->ppd_uri, ppd_uri))
+    return;
+  if ((entry = add_entry(ppd_uri, failed, keybuf)) == NULL)
+    return;
+
+  cache_path(path, sizeof(path), "matches");
+  if ((fp = cupsFileOpen(path, "a")) != NULL) {
+    print_entry(fp, entry);
+    cupsFileClose(fp);
+  }
+}
+
+/*
+ * ppd_cache_put() - Remember the PPD cups-driverd gave us for
+ * make_and_model and device_id.
+ */
+void ppd_cache_put(const char *make_and_model, const char *device_id,
+		   const char *ppd_uri) {
+  pthread_mutex_lock(&cache_lock);
+  cache_put(make_and_model, device_id, ppd_uri, 0);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * ppd_cache_put_none() - Remember that cups-driverd has no PPD for
+ * make_and_model and device_id.
+ */
+void ppd_cache_put_none(const char *make_and_model, const char *device_id) {
+  if (negative_ttl() <= 0)
+    return;
+  pthread_mutex_lock(&cache_lock);
+  cache_put(make_and_model, device_id, "", time(NULL));
+  pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,34 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Persistent cache of the ppd-URIs cups-driverd found for a make and
+ *  model and 1284 device ID.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#ifndef PAF_PPD_CACHE_H
+
+#define PAF_PPD_CACHE_H 1
+
+#include <stddef.h>
+
+/* Keys of ppd_device_id_key() */
+#define PPD_ID_MFG 0
+#define PPD_ID_MDL 1
+#define PPD_ID_CMD 2
+
+int ppd_cache_get(const char *make_and_model, const char *device_id,
+		  const char *ppd);
+void ppd_cache_put(const char *make_and_model, const char *device_id,
+		   const char *ppd_uri);
+void ppd_cache_put_none(const char *make_and_model, const char *device_id);
+void ppd_driver_stamp(char *stamp, size_t len);
+void ppd_normalize(const char *in, size_t inlen, char *out, size_t len);
+int ppd_device_id_key(const char *device_id, int key, char *out,
+		      size_t len);
+
+#endif
@@ -0,0 +1,401 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  In-memory index of the PPD catalog. "cups-driverd list" scans and
+ *  scores the whole driver database for every new printer, and packages
+ *  like hplip or gutenprint ship thousands of PPDs. Instead we read the
+ *  catalog once (limit 0, like "list -p") and index it by
+ *
+ *    id:<mfg>|<mdl>  the MFG and MDL of the 1284 device ID of a PPD
+ *    w:<word>        each word of its make and model
+ *
+ *  A printer is matched by its device ID first, else by requiring all
+ *  words of its model in the PPD's make and model. Only if neither gives
+ *  a match do we ask "cups-driverd list" as before; cups-driverd is then
+ *  only run to "cat" the chosen PPD. The index is rebuilt when the
+ *  driver stamp (see ppd_cache.c) changes.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#include "server.h"
+#include "ppd_cache.h"
+#include "ppd_index.h"
+#include "supervisor.h"
+
+typedef struct {
+  char *uri;
+  char *words;          /* " word word ... ", make and model */
+  char *id_cmd;         /* CMD of its device ID, or NULL */
+  int num_words;
+} catalog_entry_t;
+
+typedef struct {
+  char *token;          /* NULL for a free slot */
+  int *ids, num, alloc;
+} posting_t;
+
+static catalog_entry_t *catalog = NULL;
+static int num_entries = 0, alloc_entries = 0;
+static posting_t *postings = NULL;
+static int num_postings = 0, size_postings = 0;  /* size is a power of 2 */
+static char catalog_stamp[1024] = "";
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hash_token(const char *token) {
+  unsigned hash = 2166136261u;
+
+  for (; *token; token++)
+    hash = (hash ^ (*token & 255)) * 16777619u;
+  return hash;
+}
+
+/*
+ * find_posting() - Posting list of token, added if create is set.
+ */
+static posting_t *find_posting(const char *token, int create) {
+  posting_t *old = postings, *p;
+  int i, size = size_postings;
+
+  if (create && 2 * (num_postings + 1) > size_postings) {
+    /* Grow the open addressing table and rehash */
+    size_postings = size_postings ? 2 * size_postings : 4096;
+    if ((postings = calloc(size_postings, sizeof(posting_t))) == NULL) {
+      postings = old;
+      size_postings = size;
+      return NULL;
+    }
+    for (i = 0; i < size; i++)
+      if (old[i].token) {
+	for (p = postings + (hash_token(old[i].token) & (size_postings - 1));
+	     p->token;
+	     p = postings + ((p - postings + 1) & (size_postings - 1)));
+	*p = old[i];
+      }
+    free(old);
+  }
+  if (!size_postings)
+    return NULL;
+
+  for (p = postings + (hash_token(token) & (size_postings - 1)); p->token;
+       p = postings + ((p - postings + 1) & (size_postings - 1)))
+    if (!strcmp(p->token, token))
+      return p;
+  if (!create || (p->token = strdup(token)) == NULL)
+    return NULL;
+  num_postings++;
+  return p;
+}
+
+static void add_posting(const char *token, int id) {
+  posting_t *p;
+  int *ids;
+
+  if ((p = find_posting(token, 1)) == NULL ||
+      (p->num && p->ids[p->num - 1] == id))
+    return;
+  if (p->num == p->alloc) {
+    if ((ids = realloc(p->ids, (p->alloc + 8) * sizeof(int))) == NULL)
+      return;
+    p->ids = ids;
+    p->alloc += 8;
+  }
+  p->ids[p->num++] = id;
+}
+
+/*
+ * canonical_mfg() - Manufacturer names as cups-driverd compares them.
+ */
+static const char *canonical_mfg(const char *mfg) {
+  if (!strcmp(mfg, "hewlett-packard") || !strcmp(mfg, "hewlett packard"))
+    return "hp";
+  return mfg;
+}
+
+/*
+ * split_words() - Normalize in into " word word ... " of its lowercase
+ * alphanumeric runs, with manufacturer aliases resolved.
+ * Returns the number of words.
+ */
+static int split_words(const char *in, char *out, size_t len) {
+  char temp[1024];
+  const char *ptr = temp, *end;
+  int count = 0;
+
+  ppd_normalize(in, strlen(in), temp, sizeof(temp));
+  strlcpy(out, " ", len);
+  if (!strncmp(temp, "hewlett-packard", 15) ||
+      !strncmp(temp, "hewlett packard", 15)) {
+    strlcat(out, "hp ", len);
+    ptr += 15;
+    count++;
+  }
+  for (; *ptr; ptr = end) {
+    while (*ptr && !isalnum(*ptr & 255))
+      ptr++;
+    for (end = ptr; isalnum(*end & 255); end++);
+    if (end == ptr || strlen(out) + (end - ptr) + 2 > len)
+      break;
+    strncat(out, ptr, end - ptr);
+    strlcat(out, " ", len);
+    count++;
+  }
+  return count;
+}
+
+/*
+ * add_catalog_line() - Index a line "<ppd-uri> ... (<make and model>)"
+ * of "cups-driverd list", which may carry the PPD's 1284 device ID.
+ */
+static void add_catalog_line(char *line) {
+  catalog_entry_t *entry;
+  char words[1024], mfg[256], mdl[256], cmd[256], token[600], *open,
+       *close = NULL, *ptr, *end;
+  const char *id;
+
+  if ((end = strchr(line, ' ')) == NULL)
+    return;
+  *end++ = '\0';
+  if ((open = strchr(end, '(')) != NULL && (close = strrchr(end, ')')) &&
+      close > open) {
+    *close = '\0';
+    end = open + 1;
+  }
+
+  if (num_entries == alloc_entries) {
+    catalog_entry_t *temp = realloc(catalog, (alloc_entries + 1024) *
+				    sizeof(catalog_entry_t));
+    if (temp == NULL)
+      return;
+    catalog = temp;
+    alloc_entries += 1024;
+  }
+  entry = catalog + num_entries;
+  memset(entry, 0, sizeof(*entry));
+  entry->num_words = split_words(end, words, sizeof(words));
+  if ((entry->uri = strdup(line)) == NULL ||
+      (entry->words = strdup(words)) == NULL) {
+    free(entry->uri);
+    return;
+  }
+
+  for (ptr = words + 1; *ptr; ptr = end + 1) {
+    end = strchr(ptr, ' ');
+    snprintf(token, sizeof(token), "w:%.*s", (int)(end - ptr), ptr);
+    add_posting(token, num_entries);
+  }
+
+  /* The device ID, if the line has one, follows the make and model */
+  ptr = close ? close + 1 : end;
+  if (((id = strcasestr(ptr, "MFG:")) != NULL ||
+       (id = strcasestr(ptr, "MANUFACTURER:")) != NULL) &&
+      !ppd_device_id_key(id, PPD_ID_MFG, mfg, sizeof(mfg)) &&
+      !ppd_device_id_key(id, PPD_ID_MDL, mdl, sizeof(mdl))) {
+    snprintf(token, sizeof(token), "id:%s|%s", canonical_mfg(mfg), mdl);
+    add_posting(token, num_entries);
+    if (!ppd_device_id_key(id, PPD_ID_CMD, cmd, sizeof(cmd)))
+      entry->id_cmd = strdup(cmd);
+  }
+  num_entries++;
+}
+
+static void free_index(void) {
+  int i;
+
+  for (i = 0; i < num_entries; i++) {
+    free(catalog[i].uri);
+    free(catalog[i].words);
+    free(catalog[i].id_cmd);
+  }
+  for (i = 0; i < size_postings; i++)
+    if (postings[i].token) {
+      free(postings[i].token);
+      free(postings[i].ids);
+    }
+  free(catalog);
+  free(postings);
+  catalog = NULL;
+  postings = NULL;
+  num_entries = alloc_entries = num_postings = size_postings = 0;
+}
+
+/*
+ * build_index() - (Re)read the catalog if the drivers changed. A
+ * cups-driverd list which did not finish leaves no catalog, so the next
+ * call tries again.
+ * Returns -1 if there is no catalog.
+ */
+static int build_index(void) {
+  char program[2048], stamp[1024], line[4096], *argv[6];
+  cups_file_t *errlog, *fp;
+  pthread_t logThread;
+  struct timespec start, end;
+  int pid, status;
+
+  ppd_driver_stamp(stamp, sizeof(stamp));
+  if (!strcmp(stamp, catalog_stamp))
+    return num_entries ? 0 : -1;
+  free_index();
+  strlcpy(catalog_stamp, stamp, sizeof(catalog_stamp));
+
+  snprintf(program, sizeof(program), "%s%s/daemon/cups-driverd", snap,
+	   SERVERBIN);
+
+  argv[0] = (char*) "cups-driverd";
+  argv[1] = (char*) "list";
+  argv[2] = (char*) "0";        /* Request ID */
+  argv[3] = (char*) "0";        /* No limit */
+  argv[4] = (char*) "";
+  argv[5] = NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if ((fp = cupsdPipeCommand2(&pid, program, argv, driverd_env(), &errlog,
+			      0)) == NULL) {
+    debug_printf("ERROR: Unable to execute cups-driverd!\n");
+    cupsFileClose(errlog);
+    catalog_stamp[0] = '\0';
+    return -1;
+  }
+  supervise(pid, "cups-driverd", helper_timeout(), NULL, NULL);
+  logFromFile2(&logThread, errlog);
+  while (cupsFileGets(fp, line, sizeof(line)))
+    add_catalog_line(line);
+  cupsFileClose(fp);
+  pid = supervise_wait(pid, &status);
+  pthread_join(logThread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (pid <= 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    /* Cut short, e.g. past HELPER_TIMEOUT: retry on the next match */
+    debug_printf("ERROR: cups-driverd list failed, not using the %d PPDs "
+		 "it listed\n", num_entries);
+    free_index();
+    catalog_stamp[0] = '\0';
+    return -1;
+  }
+
+  debug_printf("DEBUG: Indexed %d PPDs (%d tokens) in %.3f seconds\n",
+	       num_entries, num_postings, end.tv_sec - start.tv_sec +
+	       (end.tv_nsec - start.tv_nsec) / 1e9);
+  return num_entries ? 0 : -1;
+}
+
+/*
+ * cmd_overlap() - Number of command sets two CMD values have in common.
+ */
+static int cmd_overlap(const char *cmd, const char *other) {
+  char pattern[258];
+  const char *ptr, *end;
+  int count = 0;
+
+  if (!cmd || !other || !*cmd)
+    return 0;
+  for (ptr = cmd; *ptr; ptr = *end ? end + 1 : end) {
+    end = ptr + strcspn(ptr, ",");
+    snprintf(pattern, sizeof(pattern), "%.*s", (int)(end - ptr), ptr);
+    if (*pattern && strstr(other, pattern))
+      count++;
+  }
+  return count;
+}
+
+static int match_index(const char *make_and_model, const char *device_id,
+		       char *ppd_uri, size_t len) {
+  catalog_entry_t *entry;
+  posting_t *p, *rarest = NULL;
+  char mfg[256], mdl[256], cmd[256], model[1024], words[1024], token[600],
+       *ptr, *end;
+  int i, score, best = -1, best_score = 0, num_model = 0;
+
+  if (build_index())
+    return -1;
+
+  if (ppd_device_id_key(device_id, PPD_ID_CMD, cmd, sizeof(cmd)))
+    *cmd = '\0';
+  if (!ppd_device_id_key(device_id, PPD_ID_MFG, mfg, sizeof(mfg)) &&
+      !ppd_device_id_key(device_id, PPD_ID_MDL, mdl, sizeof(mdl))) {
+    /* An exact 1284 match wins, the best command set overlap first */
+    snprintf(token, sizeof(token), "id:%s|%s", canonical_mfg(mfg), mdl);
+    if ((p = find_posting(token, 0)) != NULL)
+      for (i = 0; i < p->num; i++) {
+	score = 1 + cmd_overlap(cmd, catalog[p->ids[i]].id_cmd);
+	if (score > best_score) {
+	  best = p->ids[i];
+	  best_score = score;
+	}
+      }
+    snprintf(model, sizeof(model), "%s %s", mfg, mdl);
+  } else
+    strlcpy(model, make_and_model, sizeof(model));
+
+  if (best < 0) {
+    /*
+     * Otherwise the make and model of the PPD has to start with the
+     * manufacturer and contain all words of the model, preferring
+     * recommended drivers and the fewest extra words. Without a model
+     * number ("Epson Stylus") that is too vague, ask cups-driverd.
+     */
+    if (split_words(model, words, sizeof(words)) < 2 ||
+	!strpbrk(strchr(words + 1, ' '), "0123456789"))
+      return -1;
+    end = strchr(words + 1, ' ');
+    for (ptr = end + 1; *ptr; ptr = end + 1) {
+      end = strchr(ptr, ' ');
+      snprintf(token, sizeof(token), "w:%.*s", (int)(end - ptr), ptr);
+      if ((p = find_posting(token, 0)) == NULL)
+	return -1;              /* No PPD has this word */
+      if (!rarest || p->num < rarest->num)
+	rarest = p;
+      num_model++;
+    }
+    for (i = 0; i < rarest->num; i++) {
+      entry = catalog + rarest->ids[i];
+      if (strncmp(entry->words, words, strchr(words + 1, ' ') - words + 1))
+	continue;               /* Other manufacturer */
+      for (ptr = strchr(words + 1, ' '); ptr[1]; ptr = end) {
+	end = strchr(ptr + 1, ' ');
+	snprintf(token, sizeof(token), "%.*s", (int)(end - ptr + 1), ptr);
+	if (!strstr(entry->words, token))
+	  break;
+      }
+      if (ptr[1])
+	continue;
+      score = 1000 - 10 * (entry->num_words - num_model - 1) +
+	      (strstr(entry->words, " recommended ") ? 100 : 0) +
+	      cmd_overlap(cmd, entry->id_cmd);
+      if (score > best_score) {
+	best = rarest->ids[i];
+	best_score = score;
+      }
+    }
+  }
+
+  if (best < 0)
+    return -1;
+  if (strlcpy(ppd_uri, catalog[best].uri, len) >= len) {
+    debug_printf("DEBUG: PPD URI %s too long, asking cups-driverd\n",
+		 catalog[best].uri);
+    return -1;
+  }
+  debug_printf("DEBUG: Catalog match for \"%s\": %s\n", make_and_model,
+	       ppd_uri);
+  return 0;
+}
+
+/*
+ * ppd_index_match() - Pick the PPD for a printer from the catalog index.
+ * Returns -
+ * -1 - No confident match, ask cups-driverd
+ * 0 - Success, ppd_uri is set
+ */
+int ppd_index_match(const char *make_and_model, const char *device_id,
+		    char *ppd_uri, size_t len) {
+  int ret;
+
+  pthread_mutex_lock(&index_lock);  /* The first caller builds the index */
+  ret = match_index(make_and_model, device_id, ppd_uri, len);
+  pthread_mutex_unlock(&index_lock);
+  return ret;
+}
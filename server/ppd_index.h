@@ -0,0 +1,21 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  In-memory index of the PPD catalog of cups-driverd.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#ifndef PAF_PPD_INDEX_H
+
+#define PAF_PPD_INDEX_H 1
+
+#include <stddef.h>
+
+int ppd_index_match(const char *make_and_model, const char *device_id,
+		    char *ppd_uri, size_t len);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Content-addressed PPD store. Every distinct PPD is kept once as
+ *
+ *    $SNAP_COMMON/tmp/ppd/store/<sha-256 of the content>.ppd
+ *
+ *  and found by the ppd-URI cups-driverd gave it through a symlink
+ *
+ *    $SNAP_COMMON/tmp/ppd/store/uri/<hash of the ppd-URI> -> ../<sha>.ppd
+ *
+ *  The PPD of each printer is a hardlink to its store entry, so a fleet
+ *  of identical printers costs one "cups-driverd cat" and one file, and
+ *  the link count of an entry is its reference count: removing a printer
+ *  just drops its link. Entries nobody links to are kept for replugged
+ *  printers and collected after STORE_MAX_AGE, or when the drivers change
+ *  (the ppd-URIs may then give other PPDs).
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#include "server.h"
+#include "ppd_cache.h"
+#include "ppd_store.h"
+#include <cups/cups.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#define STORE_MAX_AGE (30 * 24 * 60 * 60)  /* Unreferenced entries, seconds */
+
+static char store_stamp[1024] = "";
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void store_path(char *path, size_t len, const char *file) {
+  snprintf(path, len, "%s/ppd/store/%s", tmpdir, file);
+}
+
+static void uri_path(char *path, size_t len, const char *ppd_uri) {
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+
+  for (; *ppd_uri; ppd_uri++)
+    hash = (hash ^ (*ppd_uri & 255)) * 0x100000001b3ULL;
+  snprintf(path, len, "%s/ppd/store/uri/%016llx", tmpdir, hash);
+}
+
+/*
+ * collect_garbage() - Remove the entries without printers which were not
+ * used for STORE_MAX_AGE (all of them if all is set) and the ppd-URI
+ * links to removed entries (all of them if all is set).
+ */
+static void collect_garbage(int all) {
+  DIR *dir;
+  struct dirent *dent;
+  struct stat st;
+  char path[1024];
+  time_t now = time(NULL);
+  int removed = 0;
+
+  store_path(path, sizeof(path), "");
+  if ((dir = opendir(path)) != NULL) {
+    while ((dent = readdir(dir)) != NULL) {
+      if (!strstr(dent->d_name, ".ppd"))
+	continue;
+      store_path(path, sizeof(path), dent->d_name);
+      if (!stat(path, &st) && st.st_nlink == 1 &&
+	  (all || now - st.st_mtime > STORE_MAX_AGE) && !unlink(path))
+	removed++;
+    }
+    closedir(dir);
+  }
+
+  store_path(path, sizeof(path), "uri");
+  if ((dir = opendir(path)) != NULL) {
+    while ((dent = readdir(dir)) != NULL) {
+      if (dent->d_name[0] == '.')
+	continue;
+      snprintf(path, sizeof(path), "%s/ppd/store/uri/%s", tmpdir,
+	       dent->d_name);
+      if (all || stat(path, &st))  /* Dangling */
+	unlink(path);
+    }
+    closedir(dir);
+  }
+  if (removed)
+    debug_printf("DEBUG: Removed %d unused PPDs from the store\n", removed);
+}
+
+/*
+ * update_store() - Create the store on first use and collect old entries,
+ * or drop all mappings if the drivers changed since they were made.
+ * Returns -1 if the store cannot be used.
+ */
+static int update_store(void) {
+  cups_file_t *fp;
+  char path[1024], stamp[1024], line[1024];
+
+  ppd_driver_stamp(stamp, sizeof(stamp));
+  if (!strcmp(stamp, store_stamp))
+    return 0;
+
+  store_path(path, sizeof(path), "uri");
+  if (mkdir(path, 0777) && errno == ENOENT) {
+    snprintf(path, sizeof(path), "%s/ppd", tmpdir);
+    mkdir(path, 0777);
+    store_path(path, sizeof(path), "");
+    mkdir(path, 0777);
+    store_path(path, sizeof(path), "uri");
+    mkdir(path, 0777);
+  }
+
+  store_path(path, sizeof(path), "stamp");
+  line[0] = '\0';
+  if ((fp = cupsFileOpen(path, "r")) != NULL) {
+    cupsFileGets(fp, line, sizeof(line));
+    cupsFileClose(fp);
+  }
+  if (strcmp(line, stamp)) {
+    if (store_stamp[0] || line[0])
+      debug_printf("DEBUG: Drivers changed, dropping unused PPDs\n");
+    collect_garbage(1);
+    if ((fp = cupsFileOpen(path, "w")) == NULL) {
+      debug_printf("ERROR: Unable to write %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+    cupsFilePrintf(fp, "%s\n", stamp);
+    cupsFileClose(fp);
+  } else if (!store_stamp[0])
+    collect_garbage(0);
+  strlcpy(store_stamp, stamp, sizeof(store_stamp));
+  return 0;
+}
+
+static int check_store(void) {
+  int ret;
+
+  pthread_mutex_lock(&store_lock);
+  ret = update_store();
+  pthread_mutex_unlock(&store_lock);
+  return ret;
+}
+
+/*
+ * ppd_store_link() - Link the stored PPD of ppd_uri to the path ppd.
+ * Returns -
+ * -1 - Not in the store
+ * 0 - Success
+ */
+int ppd_store_link(const char *ppd_uri, const char *ppd) {
+  char path[1024];
+
+  if (check_store())
+    return -1;
+  uri_path(path, sizeof(path), ppd_uri);
+  unlink(ppd);
+  if (linkat(AT_FDCWD, path, AT_FDCWD, ppd, AT_SYMLINK_FOLLOW))
+    return -1;
+  utimensat(AT_FDCWD, path, NULL, 0);  /* Last use, for the collection */
+  debug_printf("DEBUG: Using stored PPD of %s\n", ppd_uri);
+  return 0;
+}
+
+/*
+ * ppd_store_add() - Move the PPD file ppd of ppd_uri into the store,
+ * leaving a link to the store entry at ppd. If the store has the same
+ * content already, ppd becomes a link to that instead.
+ * Returns -
+ * -1 - Error, ppd is left alone
+ * 0 - Success
+ */
+int ppd_store_add(const char *ppd_uri, const char *ppd) {
+  unsigned char hash[32];
+  char hex[65], file[80], path[1024], link_path[1024], temp[1024];
+  struct stat st;
+  void *data;
+  int fd;
+
+  if (check_store())
+    return -1;
+  if ((fd = open(ppd, O_RDONLY | O_CLOEXEC)) < 0)
+    return -1;
+  if (fstat(fd, &st) || !st.st_size ||
+      (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+      MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  if (cupsHashData("sha-256", data, st.st_size, hash, sizeof(hash)) < 0) {
+    munmap(data, st.st_size);
+    close(fd);
+    return -1;
+  }
+  munmap(data, st.st_size);
+  close(fd);
+  cupsHashString(hash, sizeof(hash), hex, sizeof(hex));
+  snprintf(file, sizeof(file), "%s.ppd", hex);
+  store_path(path, sizeof(path), file);
+
+  if (link(ppd, path)) {
+    if (errno != EEXIST) {
+      debug_printf("ERROR: Unable to store %s: %s\n", ppd, strerror(errno));
+      return -1;
+    }
+    /* Same content from another printer or ppd-URI, share that */
+    snprintf(temp, sizeof(temp), "%s.tmp", ppd);
+    unlink(temp);
+    if (link(path, temp) || rename(temp, ppd)) {
+      unlink(temp);
+      return -1;
+    }
+  }
+
+  uri_path(link_path, sizeof(link_path), ppd_uri);
+  snprintf(temp, sizeof(temp), "%s.tmp", link_path);
+  snprintf(path, sizeof(path), "../%s", file);
+  unlink(temp);
+  if (symlink(path, temp) || rename(temp, link_path)) {
+    debug_printf("ERROR: Unable to link %s: %s\n", link_path,
+		 strerror(errno));
+    unlink(temp);
+  }
+  return 0;
+}
+
+/*
+ * ppd_store_release() - Drop the PPD of a removed printer. Its store
+ * entry stays for other printers of the model and for a replug.
+ * Returns the number of printers still using the entry, or -1 on error.
+ */
+int ppd_store_release(const char *ppd) {
+  struct stat st;
+
+  if (stat(ppd, &st) || unlink(ppd))
+    return -1;
+  return (st.st_nlink > 2 ? (int)st.st_nlink - 2 : 0);
+}
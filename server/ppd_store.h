@@ -0,0 +1,20 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Content-addressed store of the PPDs of the printers.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#ifndef PAF_PPD_STORE_H
+
+#define PAF_PPD_STORE_H 1
+
+int ppd_store_link(const char *ppd_uri, const char *ppd);
+int ppd_store_add(const char *ppd_uri, const char *ppd);
+int ppd_store_release(const char *ppd);
+
+#endif
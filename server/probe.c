@@ -0,0 +1,650 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Targeted probing of hot-plugged local printers without running the
+ *  backends.
+ *
+ *  On a USB add event we only look at the device which was plugged in:
+ *  its printer class interface gives us the IEEE-1284 device ID (from
+ *  usblp's sysfs attribute or a GET_DEVICE_ID class request through
+ *  usbfs) and we build the same device URI the CUPS usb backend would
+ *  report for it.
+ *
+ *  Full scans of the usb and parallel subsystems (e.g. at startup) read
+ *  the printers from sysfs and procfs the same way; the backends are only
+ *  run when some printer cannot be resolved there.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#include "server.h"
+#include "probe.h"
+#include "backends.h"
+#include <libudev.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/usb/ch9.h>
+
+#define USB_CLASS_PRINTER 7
+#define PARPORT_PROBE "/proc/sys/dev/parport/parport%d/autoprobe"
+#define USB_GET_DEVICE_ID_TIMEOUT 5000 /* milliseconds */
+
+static struct udev *udev = NULL;  /* Main loop only */
+
+/*
+ * sysattr_int() - Numeric sysfs attribute of a udev device, -1 if missing.
+ */
+static int sysattr_int(struct udev_device *dev, const char *attr, int base) {
+  const char *p = udev_device_get_sysattr_value(dev, attr);
+
+  if (p == NULL)
+    return -1;
+  return (int)strtol(p, NULL, base);
+}
+
+/*
+ * get_1284_value() - Copy the value of key from an IEEE-1284 device ID.
+ * Returns a pointer to value or NULL if the key is not present.
+ */
+static char *get_1284_value(const char *device_id, const char *key,
+			    char *value, int len) {
+  const char *p = device_id, *end;
+  int keylen = strlen(key), i;
+
+  while (p && *p) {
+    while (isspace(*p & 255))
+      p++;
+    if (!strncasecmp(p, key, keylen) && p[keylen] == ':') {
+      p += keylen + 1;
+      if ((end = strchr(p, ';')) == NULL)
+	end = p + strlen(p);
+      for (i = 0; i < len - 1 && p < end; i++, p++)
+	value[i] = *p;
+      while (i > 0 && isspace(value[i - 1] & 255))
+	i--;
+      value[i] = '\0';
+      return (i ? value : NULL);
+    }
+    if ((p = strchr(p, ';')) != NULL)
+      p++;
+  }
+  return NULL;
+}
+
+/*
+ * usb_get_device_id() - Read the IEEE-1284 device ID of a printer interface.
+ * Returns -
+ * -1 - Error
+ * 0  - Success
+ */
+static int usb_get_device_id(struct udev_device *usbdev,
+			     struct udev_device *intf,
+			     char *device_id, int len) {
+  const char *p;
+  unsigned char buf[2048];
+  struct usbdevfs_ctrltransfer ctrl;
+  unsigned int ifnum;
+  int fd, n, length, config, alt;
+
+  /*
+   * usblp exports the ID it read at probe time...
+   */
+
+  if ((p = udev_device_get_sysattr_value(intf, "ieee1284_id")) && *p) {
+    strlcpy(device_id, p, len);
+    return 0;
+  }
+
+  /*
+   * ... otherwise ask the printer through usbfs, like the usb backend does.
+   */
+
+  if ((p = udev_device_get_devnode(usbdev)) == NULL)
+    return -1;
+  ifnum = sysattr_int(intf, "bInterfaceNumber", 16);
+  alt = sysattr_int(intf, "bAlternateSetting", 10);
+  config = sysattr_int(usbdev, "bConfigurationValue", 10);
+  if ((int)ifnum < 0 || alt < 0 || config < 1)
+    return -1;
+
+  if ((fd = open(p, O_RDWR | O_CLOEXEC)) < 0) {
+    debug_printf("DEBUG: Unable to open %s: %s\n", p, strerror(errno));
+    return -1;
+  }
+  if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &ifnum) < 0) {
+    close(fd);
+    /* Claimed by usblp in the meantime? */
+    if ((p = udev_device_get_sysattr_value(intf, "ieee1284_id")) && *p) {
+      strlcpy(device_id, p, len);
+      return 0;
+    }
+    debug_printf("DEBUG: Unable to claim interface %u: %s\n", ifnum,
+		 strerror(errno));
+    return -1;
+  }
+
+  memset(&ctrl, 0, sizeof(ctrl));
+  ctrl.bRequestType = USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+  ctrl.bRequest = 0;                  /* GET_DEVICE_ID */
+  ctrl.wValue = config - 1;           /* Configuration index */
+  ctrl.wIndex = (ifnum << 8) | alt;
+  ctrl.wLength = sizeof(buf);
+  ctrl.timeout = USB_GET_DEVICE_ID_TIMEOUT;
+  ctrl.data = buf;
+  n = ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+  ioctl(fd, USBDEVFS_RELEASEINTERFACE, &ifnum);
+  close(fd);
+  if (n < 2)
+    return -1;
+
+  /*
+   * The first two bytes are the length in network byte order, but some
+   * printers get that wrong...
+   */
+
+  length = (buf[0] << 8) | buf[1];
+  if (length > n || length < 14)
+    length = (buf[1] << 8) | buf[0];
+  if (length > n)
+    length = n;
+  if (length < 3)
+    return -1;
+  length -= 2;
+  if (length > len - 1)
+    length = len - 1;
+  memcpy(device_id, buf + 2, length);
+  device_id[length] = '\0';
+  return 0;
+}
+
+/*
+ * usb_make_device_uri() - Build the device URI and make and model of a
+ * USB printer the way the CUPS usb backend does, so that the devices we
+ * probe match the ones the backend reports.
+ */
+static void usb_make_device_uri(struct udev_device *usbdev, int iface,
+				const char *device_id,
+				char *uri, int urilen,
+				char *make_model, int mmlen) {
+  char mfgbuf[256], mdlbuf[256], sern[256], options[1024];
+  const char *mfg, *mdl, *p;
+  int mfglen;
+
+  if (!get_1284_value(device_id, "SERIALNUMBER", sern, sizeof(sern)) &&
+      !get_1284_value(device_id, "SERN", sern, sizeof(sern)) &&
+      !get_1284_value(device_id, "SN", sern, sizeof(sern))) {
+    if ((p = udev_device_get_sysattr_value(usbdev, "serial")))
+      strlcpy(sern, p, sizeof(sern));
+    else
+      sern[0] = '\0';
+  }
+
+  if (!(mfg = get_1284_value(device_id, "MANUFACTURER", mfgbuf,
+			     sizeof(mfgbuf))))
+    mfg = get_1284_value(device_id, "MFG", mfgbuf, sizeof(mfgbuf));
+  if (!(mdl = get_1284_value(device_id, "MODEL", mdlbuf, sizeof(mdlbuf))))
+    mdl = get_1284_value(device_id, "MDL", mdlbuf, sizeof(mdlbuf));
+
+  if (mfg) {
+    if (!strcasecmp(mfg, "Hewlett-Packard"))
+      mfg = "HP";
+    else if (!strcasecmp(mfg, "Lexmark International"))
+      mfg = "Lexmark";
+  } else if (mdl || (mdl = get_1284_value(device_id, "DES", mdlbuf,
+					  sizeof(mdlbuf)))) {
+    strlcpy(mfgbuf, mdl, sizeof(mfgbuf));
+    if ((p = strchr(mfgbuf, ' ')))
+      mfgbuf[p - mfgbuf] = '\0';
+    mfg = mfgbuf;
+  } else
+    mfg = "Unknown";
+
+  if (!mdl)
+    mdl = strncasecmp(mfg, "Unknown", 7) ? "Unknown Model" : "Printer";
+
+  mfglen = strlen(mfg);
+  if (!strncasecmp(mdl, mfg, mfglen) && isspace(mdl[mfglen] & 255)) {
+    mdl += mfglen + 1;
+    while (isspace(*mdl & 255))
+      mdl++;
+  }
+
+  if (sern[0] && iface > 0)
+    snprintf(options, sizeof(options), "?serial=%s&interface=%d", sern,
+	     iface);
+  else if (sern[0])
+    snprintf(options, sizeof(options), "?serial=%s", sern);
+  else if (iface > 0)
+    snprintf(options, sizeof(options), "?interface=%d", iface);
+  else
+    options[0] = '\0';
+
+  httpAssembleURIf(HTTP_URI_CODING_ALL, uri, urilen, "usb", NULL, mfg, 0,
+		   "/%s%s", mdl, options);
+  snprintf(make_model, mmlen, "%s %s", mfg, mdl);
+}
+
+/*
+ * usb_printer_intf() - The printer interface of usbdev the usb backend
+ * would use: class 7, subclass 1, the highest protocol between 1 and 3.
+ * Returns a new reference to the interface, or NULL with *incomplete set
+ * if the interfaces of the device are not all registered yet.
+ */
+static struct udev_device *usb_printer_intf(struct udev_device *usbdev,
+					    int *incomplete) {
+  struct udev_device *intf, *best = NULL;
+  struct udev_enumerate *en;
+  struct udev_list_entry *entry;
+  const char *syspath = udev_device_get_syspath(usbdev);
+  int found = 0, protocol, best_protocol = 0;
+
+  *incomplete = 0;
+  if ((en = udev_enumerate_new(udev)) == NULL) {
+    *incomplete = 1;
+    return NULL;
+  }
+  udev_enumerate_add_match_parent(en, usbdev);
+  udev_enumerate_add_match_subsystem(en, "usb");
+  udev_enumerate_scan_devices(en);
+
+  udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(en)) {
+    if ((intf = udev_device_new_from_syspath(udev,
+			  udev_list_entry_get_name(entry))) == NULL)
+      continue;
+    /* Skip the interfaces of devices behind a hub */
+    if (udev_device_get_devtype(intf) &&
+	!strcmp(udev_device_get_devtype(intf), "usb_interface") &&
+	udev_device_get_parent(intf) &&
+	!strcmp(udev_device_get_syspath(udev_device_get_parent(intf)),
+		syspath)) {
+      found++;
+      protocol = sysattr_int(intf, "bInterfaceProtocol", 16);
+      if (sysattr_int(intf, "bInterfaceClass", 16) == USB_CLASS_PRINTER &&
+	  sysattr_int(intf, "bInterfaceSubClass", 16) == 1 &&
+	  protocol >= 1 && protocol <= 3 && protocol > best_protocol) {
+	if (best)
+	  udev_device_unref(best);
+	best = udev_device_ref(intf);
+	best_protocol = protocol;
+      }
+    }
+    udev_device_unref(intf);
+  }
+  udev_enumerate_unref(en);
+
+  if (best == NULL && found < sysattr_int(usbdev, "bNumInterfaces", 10))
+    *incomplete = 1;
+  return best;
+}
+
+/*
+ * probe_usb_device(const char*) - Probe the USB device at syspath and add
+ * its printer interface to temp_devices.
+ * Returns -
+ * -1 - The device looks like a printer but could not be resolved, the
+ *      caller should fall back to the usb backends.
+ * else Number of printers added to temp_devices (0 or 1).
+ */
+int probe_usb_device(const char *syspath) {
+  struct udev_device *usbdev, *best;
+  char device_id[2048], uri[1024], make_model[512];
+  int incomplete, ret = 0;
+
+  if (udev == NULL && (udev = udev_new()) == NULL) {
+    debug_printf("ERROR: udev_new() failed!\n");
+    return -1;
+  }
+  if ((usbdev = udev_device_new_from_syspath(udev, syspath)) == NULL) {
+    debug_printf("DEBUG: USB device %s is gone\n", syspath);
+    return 0;
+  }
+
+  if ((best = usb_printer_intf(usbdev, &incomplete)) == NULL) {
+    if (incomplete) {
+      debug_printf("DEBUG: Interfaces of %s not registered yet\n", syspath);
+      ret = -1;
+    }
+  } else if (usb_get_device_id(usbdev, best, device_id,
+			       sizeof(device_id))) {
+    debug_printf("DEBUG: Unable to get device ID of %s\n", syspath);
+    ret = -1;
+  } else {
+    usb_make_device_uri(usbdev, sysattr_int(best, "bInterfaceNumber", 16),
+			device_id, uri, sizeof(uri), make_model,
+			sizeof(make_model));
+    debug_printf("DEBUG: Probed %s: %s \"%s\"\n", syspath, uri, device_id);
+    if (process_device("direct", make_model, make_model, uri, device_id,
+		       NULL) == 0)
+      ret = 1;
+  }
+
+  if (best)
+    udev_device_unref(best);
+  udev_device_unref(usbdev);
+  return ret;
+}
+
+/*
+ * clear_temp_devices() - Empty temp_devices before a new probe.
+ */
+static void clear_temp_devices(void) {
+  device_t *temp;
+
+  for (temp = cupsArrayFirst(temp_devices); temp;
+       temp = cupsArrayNext(temp_devices)) {
+    cupsArrayRemove(temp_devices, temp);
+    free(temp);
+  }
+}
+
+/*
+ * vendor_backends() - Extra backends (SNAP_BACKENDS) which can report
+ * devices of transport have to see every local device too, so we cannot
+ * stand in for a backend scan.
+ */
+static int vendor_backends(int transport) {
+  char list[1024] = "";
+
+  return (backends_for(transport, list, sizeof(list)) > 0);
+}
+
+/*
+ * probe_usb_all() - Add all USB printers known to sysfs to temp_devices.
+ * Returns -
+ * -1 - Some printer could not be resolved.
+ * else Number of printers found.
+ */
+static int probe_usb_all(void) {
+  struct udev_enumerate *en;
+  struct udev_list_entry *entry;
+  struct udev_device *intf, *usbdev;
+  cups_array_t *devices;
+  char *syspath;
+  int ret = 0, count = 0;
+
+  if ((en = udev_enumerate_new(udev)) == NULL)
+    return -1;
+  udev_enumerate_add_match_subsystem(en, "usb");
+  udev_enumerate_add_match_sysattr(en, "bInterfaceClass", "07");
+  if (udev_enumerate_scan_devices(en) < 0) {
+    udev_enumerate_unref(en);
+    return -1;
+  }
+
+  /* Collect the devices of all printer class interfaces, once each */
+  devices = cupsArrayNew3((cups_array_func_t)strcmp, NULL, NULL, 0,
+			  (cups_acopy_func_t)strdup, (cups_afree_func_t)free);
+  udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(en)) {
+    if ((intf = udev_device_new_from_syspath(udev,
+			  udev_list_entry_get_name(entry))) == NULL)
+      continue;
+    if ((usbdev = udev_device_get_parent_with_subsystem_devtype(intf, "usb",
+					      "usb_device")) != NULL &&
+	!cupsArrayFind(devices, (void *)udev_device_get_syspath(usbdev)))
+      cupsArrayAdd(devices, (void *)udev_device_get_syspath(usbdev));
+    udev_device_unref(intf);
+  }
+  udev_enumerate_unref(en);
+
+  for (syspath = cupsArrayFirst(devices); syspath;
+       syspath = cupsArrayNext(devices)) {
+    int found = probe_usb_device(syspath);
+    if (found < 0)
+      ret = -1;
+    else
+      count += found;
+  }
+  cupsArrayDelete(devices);
+  return (ret < 0 ? ret : count);
+}
+
+/*
+ * probe_parallel_all() - Add all parallel port printers to temp_devices,
+ * reading the device ID the kernel fetched when the port was probed
+ * instead of opening the port. URIs are those of the CUPS parallel
+ * backend.
+ * Returns -
+ * -1 - Some printer could not be resolved.
+ * else Number of printers found.
+ */
+static int probe_parallel_all(void) {
+  struct udev_enumerate *en;
+  struct udev_list_entry *entry;
+  cups_file_t *fp;
+  const char *sysname;
+  char probe[256], line[256], device_id[1024], uri[64], info[32],
+       make[128], model[256], make_model[512];
+  int port, ret = 0, count = 0;
+
+  if ((en = udev_enumerate_new(udev)) == NULL)
+    return -1;
+  udev_enumerate_add_match_subsystem(en, "printer");
+  udev_enumerate_add_match_sysname(en, "lp*");
+  if (udev_enumerate_scan_devices(en) < 0) {
+    udev_enumerate_unref(en);
+    return -1;
+  }
+
+  udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(en)) {
+    sysname = strrchr(udev_list_entry_get_name(entry), '/');
+    if (!sysname || sscanf(sysname, "/lp%d", &port) != 1)
+      continue;
+
+    snprintf(probe, sizeof(probe), PARPORT_PROBE, port);
+    device_id[0] = '\0';
+    if ((fp = cupsFileOpen(probe, "r")) != NULL) {
+      /* One "KEY:value;" pair per line */
+      while (cupsFileGets(fp, line, sizeof(line)))
+	strlcat(device_id, line, sizeof(device_id));
+      cupsFileClose(fp);
+    }
+    if (!get_1284_value(device_id, "MANUFACTURER", make, sizeof(make)) &&
+	!get_1284_value(device_id, "MFG", make, sizeof(make))) {
+      debug_printf("DEBUG: No device ID for parallel port %d\n", port);
+      ret = -1;
+      continue;
+    }
+    if (!get_1284_value(device_id, "MODEL", model, sizeof(model)) &&
+	!get_1284_value(device_id, "MDL", model, sizeof(model)))
+      strlcpy(model, "Unknown", sizeof(model));
+    snprintf(make_model, sizeof(make_model), "%s %s", make, model);
+    snprintf(uri, sizeof(uri), "parallel:/dev/lp%d", port);
+    snprintf(info, sizeof(info), "LPT #%d", port + 1);
+    debug_printf("DEBUG: Probed %s: \"%s\"\n", uri, device_id);
+    if (process_device("direct", make_model, info, uri, device_id,
+		       NULL) == 0)
+      count++;
+  }
+  udev_enumerate_unref(en);
+  return (ret < 0 ? ret : count);
+}
+
+/*
+ * probe_local_devices(int, int) - Scan the usb or parallel subsystem of
+ * signal through sysfs instead of the backends. insert has the meaning
+ * of get_devices().
+ * Returns -
+ * -1 - Not possible, the caller should run the backends.
+ * else Number of printers added to or removed from con_devices.
+ */
+int probe_local_devices(int insert, int signal) {
+  char includes[16];
+  int found = -1, changes = 0;
+
+  if (vendor_backends(1 << (signal - 1) / 2))
+    return -1;
+  if (udev == NULL && (udev = udev_new()) == NULL) {
+    debug_printf("ERROR: udev_new() failed!\n");
+    return -1;
+  }
+
+  clear_temp_devices();
+  switch ((signal - 1) / 2) {
+  case (USB_ADD - 1) / 2:
+    found = probe_usb_all();
+    strlcpy(includes, "+usb", sizeof(includes));
+    break;
+  case (PARALLEL_ADD - 1) / 2:
+    found = probe_parallel_all();
+    strlcpy(includes, "+parallel", sizeof(includes));
+    break;
+  }
+  if (found < 0)
+    return -1;
+  debug_printf("DEBUG: Found %d printers of %s in sysfs\n", found,
+	       includes + 1);
+
+  if (insert != 0)
+    changes += add_devices(con_devices, temp_devices);
+  if (insert != 1)
+    changes += remove_devices(con_devices, temp_devices, includes);
+  return changes;
+}
+
+/*
+ * probe_usb_devices(cups_array_t*) - Probe the hot-plugged USB devices in
+ * syspaths and add the printers among them, leaving all other devices in
+ * con_devices alone.
+ * Returns -
+ * -1 - Some device could not be resolved, rescan with the usb backends.
+ * else Number of printers added to con_devices.
+ */
+int probe_usb_devices(cups_array_t *syspaths) {
+  char *syspath;
+  int ret = 0;
+
+  if (vendor_backends(TRANSPORT_USB))
+    return -1;
+  clear_temp_devices();
+
+  for (syspath = cupsArrayFirst(syspaths); syspath;
+       syspath = cupsArrayNext(syspaths))
+    if (probe_usb_device(syspath) < 0)
+      ret = -1;
+
+  if (ret < 0)
+    return ret;
+  return add_devices(con_devices, temp_devices);
+}
+
+/*
+ * probe_usb_serials(cups_array_t*, char*, size_t) - Collect the serial
+ * numbers of the hot-plugged USB devices in syspaths, comma separated,
+ * for a scan which stops once the backends reported all of them.
+ * Returns -
+ * -1 - Some device has no (usable) serial number or buf is too small
+ * 0 - Success
+ */
+int probe_usb_serials(cups_array_t *syspaths, char *buf, size_t len) {
+  struct udev_device *usbdev;
+  const char *serial;
+  char *syspath, *ptr = buf;
+  int ret = 0;
+
+  if (udev == NULL && (udev = udev_new()) == NULL)
+    return -1;
+  *buf = '\0';
+  for (syspath = cupsArrayFirst(syspaths); syspath && !ret;
+       syspath = cupsArrayNext(syspaths)) {
+    if ((usbdev = udev_device_new_from_syspath(udev, syspath)) == NULL)
+      continue;                 /* Gone again */
+    serial = udev_device_get_sysattr_value(usbdev, "serial");
+    if (serial == NULL || !*serial || strchr(serial, ',') ||
+	strlen(serial) + 2 > len - (ptr - buf))
+      ret = -1;
+    else
+      ptr += snprintf(ptr, len - (ptr - buf), "%s%s", ptr > buf ? "," : "",
+		      serial);
+    udev_device_unref(usbdev);
+  }
+  if (!ret && !*buf)
+    ret = -1;
+  return ret;
+}
+
+/*
+ * usb_guess_device() - Guess the make and model, device ID and URI of the
+ * printer at usbdev without talking to it: from the device ID usblp read,
+ * or else from the vendor and product strings udev has.
+ * Returns -1 if usbdev is no printer or there is nothing to guess from.
+ */
+static int usb_guess_device(struct udev_device *usbdev, device_t *dev) {
+  struct udev_device *intf;
+  const char *p, *mfg, *mdl;
+  char mfgbuf[256], mdlbuf[256], device_id[600], *ptr;
+  int incomplete, iface = -1;
+
+  if ((intf = usb_printer_intf(usbdev, &incomplete)) == NULL && !incomplete)
+    return -1;
+  if (intf) {
+    iface = sysattr_int(intf, "bInterfaceNumber", 16);
+    if ((p = udev_device_get_sysattr_value(intf, "ieee1284_id")) && *p)
+      strlcpy(dev->device_id, p, sizeof(dev->device_id));
+    udev_device_unref(intf);
+  }
+
+  if (!dev->device_id[0]) {
+    if (!(mfg = udev_device_get_sysattr_value(usbdev, "manufacturer")) &&
+	!(mfg = udev_device_get_property_value(usbdev, "ID_VENDOR")))
+      return -1;
+    if (!(mdl = udev_device_get_sysattr_value(usbdev, "product")) &&
+	!(mdl = udev_device_get_property_value(usbdev, "ID_MODEL")))
+      return -1;
+    strlcpy(mfgbuf, mfg, sizeof(mfgbuf));
+    strlcpy(mdlbuf, mdl, sizeof(mdlbuf));
+    for (ptr = mfgbuf; *ptr; ptr++)
+      if (*ptr == '_' || *ptr == ';')
+	*ptr = ' ';             /* udev's ID_VENDOR has no spaces */
+    for (ptr = mdlbuf; *ptr; ptr++)
+      if (*ptr == '_' || *ptr == ';')
+	*ptr = ' ';
+    snprintf(device_id, sizeof(device_id), "MFG:%s;MDL:%s;", mfgbuf, mdlbuf);
+    strlcpy(dev->device_id, device_id, sizeof(dev->device_id));
+  }
+
+  usb_make_device_uri(usbdev, iface, dev->device_id, dev->device_uri,
+		      sizeof(dev->device_uri), dev->device_make_and_model,
+		      sizeof(dev->device_make_and_model));
+  return 0;
+}
+
+/*
+ * probe_usb_prefetch(cups_array_t*) - Start resolving the PPDs of the
+ * hot-plugged USB devices in syspaths from what udev knows about them,
+ * while the backends still look for the devices. See prefetch_ppds().
+ * Returns - Number of devices guessed.
+ */
+int probe_usb_prefetch(cups_array_t *syspaths) {
+  struct udev_device *usbdev;
+  cups_array_t *guesses;
+  device_t *dev;
+  char *syspath;
+  int count;
+
+  if ((udev == NULL && (udev = udev_new()) == NULL) ||
+      (guesses = cupsArrayNew(NULL, NULL)) == NULL)
+    return 0;
+  for (syspath = cupsArrayFirst(syspaths); syspath;
+       syspath = cupsArrayNext(syspaths)) {
+    if ((usbdev = udev_device_new_from_syspath(udev, syspath)) == NULL)
+      continue;
+    if ((dev = calloc(1, sizeof(device_t))) != NULL &&
+	!usb_guess_device(usbdev, dev)) {
+      debug_printf("DEBUG: Guessed %s: %s \"%s\"\n", syspath,
+		   dev->device_make_and_model, dev->device_id);
+      cupsArrayAdd(guesses, dev);
+    } else
+      free(dev);
+    udev_device_unref(usbdev);
+  }
+
+  if ((count = cupsArrayCount(guesses)) > 0)
+    prefetch_ppds(guesses);
+  for (dev = cupsArrayFirst(guesses); dev; dev = cupsArrayNext(guesses))
+    free(dev);
+  cupsArrayDelete(guesses);
+  return count;
+}
@@ -0,0 +1,25 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Discovery of local (usb, parallel) printers through sysfs without
+ *  running the backends.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#ifndef PAF_PROBE_H
+
+#define PAF_PROBE_H 1
+
+#include <cups/array.h>
+
+int probe_usb_device(const char *syspath);
+int probe_usb_devices(cups_array_t *syspaths);
+int probe_usb_serials(cups_array_t *syspaths, char *buf, size_t len);
+int probe_usb_prefetch(cups_array_t *syspaths);
+int probe_local_devices(int insert, int signal);
+
+#endif
@@ -10,6 +10,13 @@
  */
 
 #include "server.h"
+#include "backends.h"
+#include "ppd_cache.h"
+#include "ppd_store.h"
+#include "ppd_index.h"
+#include "supervisor.h"
+#include "ports.h"
+#include <stdint.h>
 #include <sys/socket.h>
 
 static void DEBUG(char* x) {
@@ -45,7 +52,6 @@ void cleanup() {
 #ifdef HAVE_AVAHI
   pthread_cancel(avahiThread);
 #endif
-  pthread_mutex_destroy(&signal_lock);
 }
 
 static void kill_main(int sig, siginfo_t *siginfo, void* context) {
@@ -92,29 +98,68 @@ device_t* deviceCopy(device_t *in) {
   strcpy(out->device_make_and_model, in->device_make_and_model);
   strcpy(out->device_id, in->device_id);
   strcpy(out->ppd, in->ppd);
+  strcpy(out->backend, in->backend);
+  out->latency = in->latency;
   out->eve_pid = in->eve_pid;
+  out->port = in->port;
   return out;
 }
 
+static int prefetching = 0;        /* PPD prefetch, see prefetch_ppds() */
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+typedef struct {
+  device_t **devs;      /* New devices */
+  int num_devs, alloc_devs,
+      next;             /* Next device for a worker */
+  pthread_mutex_t lock;
+} add_pool_t;
+
+/*
+ * deviced_done() - Supervisor callback of a finished deviced.
+ */
+static void deviced_done(pid_t pid, int status, void *data) {
+  debug_printf("DEBUG2: deviced (PID %d) finished\n", pid);
+}
+
 /*
  * get_devices(int, int) - Get list of devices from deviced utility
+ * Returns -
+ * -1   - Error
+ * else Number of printers added to or removed from con_devices.
  */
 int get_devices(int insert, int signal) {
+  return find_devices(insert, signal, NULL);
+}
+
+/*
+ * find_devices(int, int, const char*) - Like get_devices(), but an add-only
+ * scan (insert == 1) ends as soon as the devices in wanted (comma separated
+ * URIs or serial numbers) or DEVICED_LIM devices have been reported. Scans
+ * which remove devices always wait for the complete list.
+ * Returns -
+ * -1   - Error
+ * else Number of printers added to or removed from con_devices.
+ */
+int find_devices(int insert, int signal, const char *wanted) {
   const char  *serverbin; /* ServerBin */
   char        program[2048]; /* Full Path to program */
-  char        *argv[7];
-  char        *env[7];
+  char        *argv[9];
+  char        **envp;
+  const char  *vars[4];
   char        name[32], reques_id[16], limit[16],
               timeout[16], user_id[16], options[1024];
   char        serverdir[1024], serverroot[1024], datadir[1024];
   process_t   *process;
-  int         process_pid, status;
+  int         status;
   char        includes[4096];
   char        isInclude = '+';
   char        tempstr[4095];
   char        arr[NUM_SIGNALS][32] = {"dnssd", "usb", "serial", "parallel"};
   cups_file_t *errlog;
   char *p;
+  int         changes = 0, seen = 0, supervised, i;
 
   /*cupsArrayClear(temp_devices);*/
   device_t *temp = cupsArrayFirst(temp_devices);
@@ -147,26 +192,17 @@ int get_devices(int insert, int signal) {
     int index = (signal - 1) / 2;
     for (int j = 0; j < strlen(arr[index]); j++, cj++)
       *cj = arr[index][j];
-    if (getenv("SNAP_BACKENDS")) {
-      *cj = ',';
-      cj++;
-      char *bk = strdup(getenv("SNAP_BACKENDS"));
-      char *t = bk;
-      while (*t) {
-	*cj = *t;
-	cj++;
-	t++;
-      }
-      free(bk);
-    }
     *cj =0;
     cj =0;
+    /* Only the extra backends which can see this kind of device */
+    backends_for(1 << index, includes, sizeof(includes));
   }
 
   debug_printf("DEBUG: Signal: %s\n", includes);
   strcpy(name, "deviced");
   strcpy(reques_id, DEVICED_REQ);
-  strcpy(limit, DEVICED_LIM);
+  /* A truncated list would make remove_devices() drop printers */
+  strcpy(limit, insert == 1 ? DEVICED_LIM : "0");
   strcpy(timeout, DEVICED_TIM);
   strcpy(user_id, DEVICED_USE);
   strcpy(options, DEVICED_OPT);
@@ -177,51 +213,69 @@ int get_devices(int insert, int signal) {
   else
     snprintf(program, sizeof(program), "%s%s/%s", snap, BINDIR, name);
   /*snprintf(program, sizeof(program), "deviced");*/
-  snprintf(serverdir, sizeof(serverdir),"%s%s", snap, SERVERBIN);
-  snprintf(serverroot, sizeof(serverroot), "%s/etc/cups", snap);
-  snprintf(datadir, sizeof(datadir), "%s/usr/share/cups", snap);
-
-  setenv("CUPS_SERVERBIN", serverdir, 1);
-  setenv("CUPS_DATADIR", datadir, 1);
-  setenv("CUPS_SERVERROOT", serverroot, 1);
-
-  argv[0] = (char*) name;
-  argv[1] = (char*) limit;
-  argv[2] = (char*) timeout;
-  argv[3] = (char*) includes;
-  argv[4] = NULL;
-
-  if ((process->pipe = cupsdPipeCommand2(&(process->pid), program, argv,
-					 &errlog, 0)) == NULL) {
+  snprintf(serverdir, sizeof(serverdir), "CUPS_SERVERBIN=%s%s", snap,
+	   SERVERBIN);
+  snprintf(serverroot, sizeof(serverroot), "CUPS_SERVERROOT=%s/etc/cups",
+	   snap);
+  snprintf(datadir, sizeof(datadir), "CUPS_DATADIR=%s/usr/share/cups", snap);
+  vars[0] = serverdir;
+  vars[1] = datadir;
+  vars[2] = serverroot;
+  vars[3] = NULL;
+
+  i = 0;
+  argv[i++] = (char*) name;
+  argv[i++] = (char*) "-b";   /* Binary device records */
+  if (signal)
+    argv[i++] = (char*) "-r"; /* Hotplug event, cached results are stale */
+  if (insert == 1 && wanted && *wanted) {
+    argv[i++] = (char*) "-w";
+    argv[i++] = (char*) wanted;
+  }
+  argv[i++] = (char*) limit;
+  argv[i++] = (char*) timeout;
+  argv[i++] = (char*) includes;
+  argv[i] = NULL;
+  process->records = 1;
+
+  envp = cupsdSpawnEnv(vars);
+  process->pipe = cupsdPipeCommand2(&(process->pid), program, argv, envp,
+				    &errlog, 0);
+  free(envp);
+  if (process->pipe == NULL) {
     debug_printf("ERROR: Unable to execute deviced!\n");
-    cupsFileClose(errlog);
     free(process);
     return (-1);
   }
+  /* A hung backend must not hold up the main loop past the deadline */
+  supervised = !supervise(process->pid, "deviced", helper_timeout(),
+			  deviced_done, NULL);
   pthread_t logThread;
   logFromFile2(&logThread, errlog);
-  if ((process_pid = waitpid(process->pid, &status, 0)) > 0) {
-    /*if (WIFEXITED(status)) {*/
-    while(!parse_line(process));
-    /*}*/
-    pthread_join(logThread,NULL);
-  } else
-    fprintf(stdout, "Failed to collect! PID ERROR! %d %s\n",
-	    process->pid, strerror(errno));
-
-  if (insert >= 0) {
-    if (insert == 1)
-      add_devices(con_devices,temp_devices);
-    else if (!insert)
-      remove_devices(con_devices,temp_devices,includes);
-    else {
-      add_devices(con_devices,temp_devices);
-      remove_devices(con_devices,temp_devices,includes);
+  pthread_detach(logThread);  /* Closes errlog when deviced exits */
+
+  /*
+   * Read the devices while the backends are still running, so that a
+   * printer is brought up as soon as its backend reports it and not
+   * after the slowest backend timed out. Removals need the complete
+   * list and wait for the end of the output.
+   */
+  while (!parse_line(process)) {
+    if (insert > 0 && cupsArrayCount(temp_devices) > seen) {
+      seen = cupsArrayCount(temp_devices);
+      changes += add_devices(con_devices, temp_devices);
     }
   }
+  if (!supervised && waitpid(process->pid, &status, 0) < 0)
+    debug_printf("ERROR: Failed to collect deviced (PID %d): %s\n",
+		 process->pid, strerror(errno));
+
+  if (insert == 0 || insert == 2)
+    changes += remove_devices(con_devices, temp_devices, includes);
+  backends_save();
 
   free(process);
-  return (0);
+  return (changes);
 }
 
 #if 0
@@ -235,128 +289,80 @@ static int parse_line(process_t *backend) {
 }
 #endif
 
+/*
+ * read_record() - Read the next binary device record from backend into
+ * buf.
+ * Returns -
+ * -1 - End of file
+ * 0 - Bad or oversized record, skipped
+ * else Length of the record payload
+ */
+static int read_record(process_t *backend, unsigned char *buf,
+		       size_t bufsize) {
+  unsigned char prefix[2];
+  size_t len, got;
+  ssize_t bytes;
+
+  for (got = 0; got < 2; got += bytes)
+    if ((bytes = cupsFileRead(backend->pipe, (char *)prefix + got,
+			      2 - got)) <= 0)
+      return -1;
+  len = (prefix[0] << 8) | prefix[1];
+
+  for (got = 0; got < len; got += bytes) {
+    if (got < bufsize)
+      bytes = cupsFileRead(backend->pipe, (char *)buf + got,
+			   (len < bufsize ? len : bufsize) - got);
+    else
+      bytes = cupsFileRead(backend->pipe, (char *)prefix,
+			   len - got > 2 ? 2 : len - got);
+    if (bytes <= 0)
+      return -1;
+  }
+  return (len <= bufsize ? (int)len : 0);
+}
+
 int				 /* O - 0 on success, -1 on error */
 parse_line(process_t *backend) { /* I - Backend to read from */
-  char line[2048],			/* Line from backend */
-       temp[2048],			/* Copy of line */
-       *ptr,				/* Pointer into line */
-       *dclass,				/* Device class */
-       *uri,				/* Device URI */
-       *make_model,			/* Make and model */
-       *info,				/* Device info */
-       *device_id,			/* 1284 device ID */
-       *location;			/* Physical location */
-
-  if (cupsFileGets(backend->pipe, line, sizeof(line))) {
+  unsigned char record[DEVICE_RECORD_MAX];	/* Record from deviced */
+  char line[2048];			/* Line from backend */
+  device_line_t dev;			/* Fields of line */
+  int len;
+
+  if (backend->records) {
+    if ((len = read_record(backend, record, sizeof(record))) > 0 &&
+	!device_record_parse(record, len, &dev)) {
+      debug_printf("DEBUG2: %s %s \"%s\" from %s after %d ms\n",
+		   dev.field[DEVICE_CLASS].data, dev.field[DEVICE_URI].data,
+		   dev.field[DEVICE_MAKE_MODEL].data,
+		   dev.field[DEVICE_BACKEND].data ?
+		   dev.field[DEVICE_BACKEND].data : "?", dev.latency);
+      process_device_line(&dev);
+      return (0);
+    } else if (len >= 0) {
+      debug_printf("ERROR: [deviced] Bad record from \"%s\"\n",
+		   backend->name);
+      return (0);
+    }
+  } else if (cupsFileGets(backend->pipe, line, sizeof(line))) {
     /*
      * Each line is of the form:
      *
      *   class URI "make model" "name" ["1284 device ID"] ["location"]
      */
 
-    strlcpy(temp, line, sizeof(temp));
     debug_printf("DEBUG2: %s\n", line);
-
-    /*
-     * device-class
-     */
-    dclass = temp;
-
-    for (ptr = temp; *ptr; ptr ++)
-      if (isspace(*ptr & 255))
-        break;
-
-    while (isspace(*ptr & 255))
-      *ptr++ = '\0';
-
-    /*
-     * device-uri
-     */
-
-    if (!*ptr)
-      goto error;
-
-    for (uri = ptr; *ptr; ptr ++)
-      if (isspace(*ptr & 255))
-        break;
-
-    while (isspace(*ptr & 255))
-      *ptr++ = '\0';
-
-    /*
-     * device-make-and-model
-     */
-
-    if (*ptr != '\"')
-      goto error;
-
-    for (ptr ++, make_model = ptr; *ptr && *ptr != '\"'; ptr ++) {
-      if (*ptr == '\\' && ptr[1])
-        _cups_strcpy(ptr, ptr + 1);
-    }
-
-    if (*ptr != '\"')
-      goto error;
-
-    for (*ptr++ = '\0'; isspace(*ptr & 255); *ptr++ = '\0');
-
-    /*
-     * device-info
-     */
-
-    if (*ptr != '\"')
-      goto error;
-
-    for (ptr ++, info = ptr; *ptr && *ptr != '\"'; ptr ++) {
-      if (*ptr == '\\' && ptr[1])
-        _cups_strcpy(ptr, ptr + 1);
-    }
-
-    if (*ptr != '\"')
-      goto error;
-
-    for (*ptr++ = '\0'; isspace(*ptr & 255); *ptr++ = '\0');
-
-    /*
-     * device-id
-     */
-
-    if (*ptr == '\"') {
-      for (ptr ++, device_id = ptr; *ptr && *ptr != '\"'; ptr ++) {
-	if (*ptr == '\\' && ptr[1])
-	  _cups_strcpy(ptr, ptr + 1);
-      }
-
-      if (*ptr != '\"')
-	goto error;
-
-      for (*ptr++ = '\0'; isspace(*ptr & 255); *ptr++ = '\0');
-
-      /*
-       * device-location
-       */
-
-      if (*ptr == '\"') {
-	for (ptr ++, location = ptr; *ptr && *ptr != '\"'; ptr ++) {
-	  if (*ptr == '\\' && ptr[1])
-	    _cups_strcpy(ptr, ptr + 1);
-	}
-
-	if (*ptr != '\"')
-	  goto error;
-
-	*ptr = '\0';
-      } else
-        location = NULL;
-    } else {
-      device_id = NULL;
-      location  = NULL;
+    if (device_line_parse(line, &dev)) {
+      /* The line is logged above, it is modified by now */
+      debug_printf("ERROR: [deviced] Bad line from \"%s\"\n",
+		   backend->name);
+      return (0);
     }
 
     /*
      * Add the device to the array of available devices...
      */
-    process_device(dclass, make_model, info, uri, device_id, location);
+    process_device_line(&dev);
     /*fprintf(stderr, "DEBUG: Found device \"%s\"...\n", uri);*/
 
     return (0);
@@ -370,19 +376,6 @@ parse_line(process_t *backend) { /* I - Backend to read from */
   backend->pipe = NULL;
 
   return (-1);
-
-  /*
-   * Bad format; strip trailing newline and write an error message.
-   */
-
-  error:
-
-  if (line[strlen(line) - 1] == '\n')
-    line[strlen(line) - 1] = '\0';
-
-  debug_printf("ERROR: [deviced] Bad line from \"%s\": %s\n",
-	       backend->name, line);
-  return (0);
 }
 
 /*
@@ -395,13 +388,41 @@ int compare_devices(device_t *d0,
   return diff;
 }
 
-static int
+int
 process_device(const char *device_class,
 	       const char *device_make_and_model,
 	       const char *device_info,
 	       const char *device_uri,
 	       const char *device_id,
 	       const char *device_location) {
+  device_line_t line;
+  const char *values[DEVICE_NUM_FIELDS];
+
+  values[DEVICE_CLASS] = device_class;
+  values[DEVICE_URI] = device_uri;
+  values[DEVICE_MAKE_MODEL] = device_make_and_model;
+  values[DEVICE_INFO] = device_info;
+  values[DEVICE_ID] = device_id;
+  values[DEVICE_LOCATION] = device_location;
+  values[DEVICE_BACKEND] = NULL;
+  for (int i = 0; i < DEVICE_NUM_FIELDS; i++) {
+    line.field[i].data = (char *)values[i];
+    line.field[i].len = values[i] ? strlen(values[i]) : 0;
+  }
+  line.latency = -1;
+  return process_device_line(&line);
+}
+
+/*
+ * process_device_line() - Add a device reported by a backend to
+ * temp_devices.
+ * Returns -
+ * -2 - Device of unknown make and model, ignored
+ * -1 - Error
+ * 0 - Success
+ */
+int process_device_line(const device_line_t *line) {
+  const device_field_t *f = line->field;
   device_t *device;
 
   if ((device = calloc(1, sizeof(device_t))) == NULL) {
@@ -409,27 +430,37 @@ process_device(const char *device_class,
     return -1;
   }
 
-  if (device_make_and_model) {
-    if (!strncasecmp(device_make_and_model, "Unknown", 7)) {
+  if (f[DEVICE_MAKE_MODEL].data) {
+    if (!strncasecmp(f[DEVICE_MAKE_MODEL].data, "Unknown", 7)) {
       free(device);
       return -2;
     }
   }
 
-  if (device_uri)
-    strlcpy(device->device_uri, device_uri, sizeof(device->device_uri));
-  if (device_class)
-    strlcpy(device->device_class, device_class, sizeof(device->device_class));
-  if (device_make_and_model)
-    strlcpy(device->device_make_and_model, device_make_and_model,
+  if (f[DEVICE_URI].data)
+    strlcpy(device->device_uri, f[DEVICE_URI].data,
+	    sizeof(device->device_uri));
+  if (f[DEVICE_CLASS].data)
+    strlcpy(device->device_class, f[DEVICE_CLASS].data,
+	    sizeof(device->device_class));
+  if (f[DEVICE_MAKE_MODEL].data)
+    strlcpy(device->device_make_and_model, f[DEVICE_MAKE_MODEL].data,
 	    sizeof(device->device_make_and_model));
-  if (device_info)
-    strlcpy(device->device_info, device_info, sizeof(device->device_info));
-  if (device_id)
-    strlcpy(device->device_id, device_id, sizeof(device->device_id));
-  if (device_location)
-    strlcpy(device->device_location, device_location,
+  if (f[DEVICE_INFO].data)
+    strlcpy(device->device_info, f[DEVICE_INFO].data,
+	    sizeof(device->device_info));
+  if (f[DEVICE_ID].data)
+    strlcpy(device->device_id, f[DEVICE_ID].data,
+	    sizeof(device->device_id));
+  if (f[DEVICE_LOCATION].data)
+    strlcpy(device->device_location, f[DEVICE_LOCATION].data,
 	    sizeof(device->device_location));
+  if (f[DEVICE_BACKEND].data)
+    strlcpy(device->backend, f[DEVICE_BACKEND].data,
+	    sizeof(device->backend));
+  device->latency = line->latency;
+  if (f[DEVICE_URI].data)
+    backends_learn(device->backend, device->device_uri);
 
   if (cupsArrayFind(temp_devices, device))
     free(device);
@@ -440,35 +471,240 @@ process_device(const char *device_class,
   return 0;
 }
 
-void add_devices(cups_array_t *con, cups_array_t *temp) {
-  device_t *dev = cupsArrayFirst(temp);
+/*
+ * device_ppd_path() - Path of the PPD of the printer at device_uri.
+ */
+static void device_ppd_path(char *ppd_name, size_t len,
+			    const char *make_and_model,
+			    const char *device_uri) {
+  char ppdn[1024], escp_model[256], ppd_folder[2048];
+
+  snprintf(ppdn, sizeof(ppdn), "%s-%s", make_and_model, device_uri);
+  escape_string(escp_model, ppdn, sizeof(escp_model));
+  snprintf(ppd_folder, sizeof(ppd_folder), "%s/ppd", tmpdir);
+  if (mkdir(ppd_folder, 0777) == -1 && errno != EEXIST)
+    debug_printf("ERROR: Cannot create directory %s: %s\n",
+		 ppd_folder, strerror(errno));
+  snprintf(ppd_name, len, "%s/ppd/%s.ppd", tmpdir, escp_model);
+}
+
+static char **driverd_envp = NULL;
+
+static void make_driverd_env(void) {
+  char datadir[1024], serverdir[1024], cachedir[1024];
+  const char *vars[] = {datadir, serverdir, cachedir, NULL};
+
+  snprintf(datadir, sizeof(datadir), "CUPS_DATADIR=%s%s", snap, DATADIR);
+  snprintf(serverdir, sizeof(serverdir), "CUPS_SERVERBIN=%s%s", snap,
+	   SERVERBIN);
+  snprintf(cachedir, sizeof(cachedir), "CUPS_CACHEDIR=%s", tmpdir);
+  driverd_envp = cupsdSpawnEnv(vars);
+}
+
+/*
+ * driverd_env() - Environment of cups-driverd, made on first use.
+ */
+char **driverd_env(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&once, make_driverd_env);
+  return driverd_envp;
+}
+
+/*
+ * prefetch_thread() - Resolve the PPDs of the guesses, an array of
+ * device_t copies, and free them.
+ */
+static void *prefetch_thread(void *data) {
+  cups_array_t *guesses = (cups_array_t *)data;
+  device_t *dev;
   char ppd[1024];
+  int ret;
+
+  for (dev = cupsArrayFirst(guesses); dev; dev = cupsArrayNext(guesses)) {
+    /* Not the PPD path of the real printer, it may be up already */
+    device_ppd_path(ppd, sizeof(ppd), dev->device_make_and_model,
+		    "prefetch");
+    ret = ppd_cache_get(dev->device_make_and_model, dev->device_id, ppd);
+    if (ret < 0)
+      ret = get_ppd(ppd, sizeof(ppd), dev->device_make_and_model,
+		    sizeof(dev->device_make_and_model), dev->device_id,
+		    sizeof(dev->device_id), "prefetch");
+    if (ret == 0)
+      ppd_store_release(ppd);  /* Only the store entry is wanted */
+    free(dev);
+  }
+  cupsArrayDelete(guesses);
 
-  for(;dev;dev=cupsArrayNext(temp)) {
+  pthread_mutex_lock(&prefetch_lock);
+  prefetching = 0;
+  pthread_cond_broadcast(&prefetch_cond);
+  pthread_mutex_unlock(&prefetch_lock);
+  return NULL;
+}
+
+/*
+ * prefetch_ppds() - Resolve the PPDs of the guessed devices on a thread
+ * while the backends are still looking for the real devices. The thread
+ * leaves the results in the PPD cache and store, where add_devices()
+ * finds them if the guess was right; a wrong guess just costs its
+ * cups-driverd runs, each of which has its own deadline.
+ */
+void prefetch_ppds(cups_array_t *guesses) {
+  cups_array_t *copies;
+  device_t *dev, *copy;
+  pthread_t thread;
+
+  prefetch_wait();
+  if ((copies = cupsArrayNew(NULL, NULL)) == NULL)
+    return;
+  for (dev = cupsArrayFirst(guesses); dev; dev = cupsArrayNext(guesses))
+    if ((copy = deviceCopy(dev)) != NULL)
+      cupsArrayAdd(copies, copy);
+
+  debug_printf("DEBUG: Prefetching %d PPDs\n", cupsArrayCount(copies));
+  pthread_mutex_lock(&prefetch_lock);
+  prefetching = 1;
+  pthread_mutex_unlock(&prefetch_lock);
+  if (pthread_create(&thread, NULL, prefetch_thread, copies)) {
+    debug_printf("ERROR: Unable to start the PPD prefetch!\n");
+    pthread_mutex_lock(&prefetch_lock);
+    prefetching = 0;
+    pthread_mutex_unlock(&prefetch_lock);
+    for (dev = cupsArrayFirst(copies); dev; dev = cupsArrayNext(copies))
+      free(dev);
+    cupsArrayDelete(copies);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+/*
+ * prefetch_wait() - Wait for the running PPD prefetch, so that its results
+ * are used instead of resolving the same PPDs again.
+ */
+void prefetch_wait(void) {
+  pthread_mutex_lock(&prefetch_lock);
+  if (prefetching)
+    debug_printf("DEBUG2: Waiting for the PPD prefetch\n");
+  while (prefetching)
+    pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+  pthread_mutex_unlock(&prefetch_lock);
+}
+
+/*
+ * resolve_ppd() - Resolve the PPD of the new device dev into dev->ppd,
+ * empty if it has none. Called by the workers of add_devices().
+ */
+static void resolve_ppd(device_t *dev) {
+  char ppd[1024];
+  int ret;
+
+  debug_printf("DEBUG: Getting PPD! |%s|%s|%s|\n",
+	       dev->device_make_and_model, dev->device_uri, dev->device_id);
+  device_ppd_path(ppd, sizeof(ppd), dev->device_make_and_model,
+		  dev->device_uri);
+  ret = ppd_cache_get(dev->device_make_and_model, dev->device_id, ppd);
+  if (ret < 0)
+    ret = get_ppd(ppd, sizeof(ppd), dev->device_make_and_model,
+		  sizeof(dev->device_make_and_model),
+		  dev->device_id, sizeof(dev->device_id),
+		  dev->device_uri);
+  if (ret == 0) {
+    strlcpy(dev->ppd, ppd, sizeof(dev->ppd));
+    debug_printf("DEBUG: PPD LOC: %s\n", dev->ppd);
+  } else {
+    dev->ppd[0] = '\0';
+    debug_printf("DEBUG: PPD not found, not adding this printer!\n");
+  }
+}
+
+/*
+ * add_worker() - Thread of add_devices(), takes the next device until
+ * none is left.
+ */
+static void *add_worker(void *data) {
+  add_pool_t *pool = (add_pool_t *)data;
+  device_t *dev;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    dev = pool->next < pool->num_devs ? pool->devs[pool->next++] : NULL;
+    pthread_mutex_unlock(&pool->lock);
     if (dev == NULL)
+      return NULL;
+    resolve_ppd(dev);
+  }
+}
+
+/*
+ * add_devices() - Add the devices of temp which are not in con yet. Their
+ * PPDs are resolved by up to PPD_WORKERS threads at once, so that the
+ * cups-driverd runs of several new printers overlap. The printers are
+ * started by the calling thread once all workers are done: ippeveprinter
+ * gets CUPSD_SPAWN_PDEATHSIG, which would fire when a worker exits.
+ * Returns - Number of devices added to con.
+ */
+int add_devices(cups_array_t *con, cups_array_t *temp) {
+  add_pool_t pool;
+  pthread_t threads[MAX_PPD_WORKERS];
+  device_t *dev;
+  const char *p;
+  device_t *newDev;
+  int workers, started, i, added = 0;
+
+  memset(&pool, 0, sizeof(pool));
+  pthread_mutex_init(&pool.lock, NULL);
+  for (dev = cupsArrayFirst(temp); dev; dev = cupsArrayNext(temp)) {
+    if (cupsArrayFind(con, dev))
+      continue;
+    if (pool.num_devs == pool.alloc_devs) {
+      device_t **devs = realloc(pool.devs, (pool.alloc_devs + 16) *
+				sizeof(device_t *));
+      if (devs == NULL)
+	break;
+      pool.devs = devs;
+      pool.alloc_devs += 16;
+    }
+    pool.devs[pool.num_devs++] = dev;
+  }
+  if (!pool.num_devs) {
+    free(pool.devs);
+    pthread_mutex_destroy(&pool.lock);
+    return 0;
+  }
+
+  prefetch_wait();
+  workers = (p = getenv("PPD_WORKERS")) ? atoi(p) : PPD_WORKERS;
+  if (workers > MAX_PPD_WORKERS)
+    workers = MAX_PPD_WORKERS;
+  if (workers > pool.num_devs)
+    workers = pool.num_devs;
+  for (started = 0; started < workers - 1; started++)
+    if (pthread_create(threads + started, NULL, add_worker, &pool))
       break;
-    if (!cupsArrayFind(con, dev)) {
-      debug_printf("DEBUG: Getting PPD! |%s|%s|%s|\n",
-		   dev->device_make_and_model, dev->device_uri, dev->device_id);
-      int ret = get_ppd(ppd, sizeof(ppd), dev->device_make_and_model,
-			sizeof(dev->device_make_and_model),
-			dev->device_id, sizeof(dev->device_id),
-			dev->device_uri);
-      if (ret >= 0) {
-        strlcpy(dev->ppd, ppd, sizeof(dev->ppd));
-        debug_printf("DEBUG: PPD LOC: %s\n", dev->ppd);
-        device_t* newDev = deviceCopy(dev);
-        cupsArrayAdd(con, newDev);
-        debug_printf("DEBUG: Adding Printer: %s\n", newDev->device_uri);
-        start_ippeveprinter(newDev);
-      } else {
-	dev->ppd[0] = '\0';
-        debug_printf("DEBUG: PPD not found, not adding this printer!\n");
-	device_t* newDev = deviceCopy(dev);
-	cupsArrayAdd(con, newDev);
-      }
+  if (started)
+    debug_printf("DEBUG: Resolving %d PPDs with %d workers\n",
+		 pool.num_devs, started + 1);
+  add_worker(&pool);            /* This thread is a worker too */
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  for (i = 0; i < pool.num_devs; i++) {
+    dev = pool.devs[i];
+    if (cupsArrayFind(con, dev) || (newDev = deviceCopy(dev)) == NULL)
+      continue;
+    cupsArrayAdd(con, newDev);
+    added++;
+    if (newDev->ppd[0]) {
+      debug_printf("DEBUG: Adding Printer: %s\n", newDev->device_uri);
+      start_ippeveprinter(newDev);
     }
   }
+
+  free(pool.devs);
+  pthread_mutex_destroy(&pool.lock);
+  return added;
 }
 
 int getBackend(char *uri, char *backend, int bklen) {
@@ -497,10 +733,10 @@ int getBackend(char *uri, char *backend, int bklen) {
   return 0;
 }
 
-void remove_devices(cups_array_t *con, cups_array_t *temp, char *includes) {
+int remove_devices(cups_array_t *con, cups_array_t *temp, char *includes) {
   device_t *dev = cupsArrayFirst(con);
   char ppd[128];
-  int inc = 1;
+  int inc = 1, removed = 0;
   if (includes[0] == '-') inc = 0;
   for (; dev; dev = cupsArrayNext(con)) {
     char backend[32];
@@ -517,7 +753,7 @@ void remove_devices(cups_array_t *con, cups_array_t *temp, char *includes) {
       if (dev->ppd[0] != '\0') {
 	remove_ppd(dev->ppd);
 	debug_printf("DEBUG: Removing Printer: %s\n", dev->device_id);
-	kill_ippeveprinter(dev->eve_pid);
+	kill_ippeveprinter(dev->eve_pid);  /* Releases its port */
 	pthread_join(dev->errlog, NULL);
       } else
 	debug_printf("DEBUG: Unsupported printer disappeared: %s\n",
@@ -525,8 +761,10 @@ void remove_devices(cups_array_t *con, cups_array_t *temp, char *includes) {
       cupsArrayRemove(con, dev);
       device_t *tt = dev;   // Do we need this?
       free(tt);
+      removed ++;
     }
   }
+  return removed;
 }
 
 /*
@@ -542,11 +780,10 @@ get_ppd(char* ppd, int ppd_len,            /* O- */
   char program[2048];
   char *argv[6];
   char name[16], operation[8], request_id[4], limit[5], options[1024];
-  char ppd_uri[128];
+  char ppd_uri[1024];
   char ppd_name[1024];  /* full ppd path */
-  char escp_model[256];
   char *envp[6];
-  char datadir[1024], serverdir[1024], cachedir[1024];
+  char serverdir[1024];
   cups_file_t *errlog;
   process_t *process;
   int        process_pid, status;
@@ -564,13 +801,7 @@ get_ppd(char* ppd, int ppd_len,            /* O- */
 	   make_and_model, device_id);
   /*snprintf(options, sizeof(options), "ppd-make-and-model=\'HP\'");*/
 
-  snprintf(datadir, sizeof(datadir), "%s%s", snap, DATADIR);
   snprintf(serverdir, sizeof(serverdir), "%s%s", snap, SERVERBIN);
-  snprintf(cachedir, sizeof(cachedir), "%s", tmpdir);
-
-  setenv("CUPS_DATADIR", datadir, 1);
-  setenv("CUPS_SERVERBIN", serverdir, 1);
-  setenv("CUPS_CACHEDIR", cachedir, 1);
   /*if((serverbin = getenv("SERVERBIN")) == NULL)
     serverbin = CUPS_SERVERBIN;*/
   snprintf(program, sizeof(program), "%s/daemon/%s", serverdir, name);
@@ -589,28 +820,43 @@ get_ppd(char* ppd, int ppd_len,            /* O- */
   envp[3] = NULL;
 #endif
 
-  debug_printf("DEBUG: Executing cups-driverd at %s\n", program);
-  if ((process->pipe = cupsdPipeCommand2(&(process->pid), program,
-					 argv, &errlog, 0)) == NULL) {
-    debug_printf("ERROR: Unable to execute!\n");
-    cupsFileClose(errlog);
-    free(process);
-    return (-1);
-  }
   pthread_t logThread;
-  logFromFile2(&logThread, errlog);
-  if ((process_pid = waitpid(process->pid, &status, 0)) > 0) {
-    if(WIFEXITED(status)) {
-      /*do {*/
-      if (get_ppd_uri(ppd_uri, process)) { /* All we need is a single line! */
-	free(process);
-	pthread_join(logThread, NULL);
-	return (-1);
-      }
-      /*fprintf(stdout,"PPD-URI: %s\n",ppd_uri);*/
-      /*} while(_cupsFilePeekAhead(process->pipe, '\n'));*/
+  if (ppd_index_match(make_and_model, device_id, ppd_uri, sizeof(ppd_uri))) {
+    debug_printf("DEBUG: Executing cups-driverd at %s\n", program);
+    if ((process->pipe = cupsdPipeCommand2(&(process->pid), program, argv,
+					   driverd_env(), &errlog, 0)) == NULL) {
+      debug_printf("ERROR: Unable to execute!\n");
+      cupsFileClose(errlog);
+      free(process);
+      return (-1);
+    }
+    supervise(process->pid, "cups-driverd", helper_timeout(), NULL, NULL);
+    logFromFile2(&logThread, errlog);
+    process_pid = supervise_wait(process->pid, &status);
+    pthread_join(logThread, NULL);
+    if (process_pid <= 0 || !WIFEXITED(status)) {  /* Crashed or timed out */
+      cupsFileClose(process->pipe);
+      free(process);
+      return (-1);
+    }
+    /*do {*/
+    /* All we need is a single line! */
+    if (get_ppd_uri(ppd_uri, sizeof(ppd_uri), process)) {
+      free(process);
+      if (!WEXITSTATUS(status))
+	ppd_cache_put_none(make_and_model, device_id);
+      return (-1);
     }
-    pthread_join(logThread,NULL);
+    /*fprintf(stdout,"PPD-URI: %s\n",ppd_uri);*/
+    /*} while(_cupsFilePeekAhead(process->pipe, '\n'));*/
+  }
+
+  device_ppd_path(ppd_name, sizeof(ppd_name), make_and_model, device_uri);
+  if (!ppd_store_link(ppd_uri, ppd_name)) {
+    free(process);
+    ppd_cache_put(make_and_model, device_id, ppd_uri);
+    strncpy(ppd, ppd_name, ppd_len);
+    return 0;
   }
 
   strcpy(operation, "cat");
@@ -618,344 +864,387 @@ get_ppd(char* ppd, int ppd_len,            /* O- */
   argv[3] = NULL;
   argv[4] = NULL;
 
-  if ((process->pipe = cupsdPipeCommand2(&(process->pid), program,
-					 argv, &errlog, 0)) == NULL) {
+  if ((process->pipe = cupsdPipeCommand2(&(process->pid), program, argv,
+					 driverd_env(), &errlog, 0)) == NULL) {
     debug_printf("ERROR: Unable to execute cups-driverd!\n");
     free(process);
     cupsFileClose(errlog);
     return (-1);
   }
+  supervise(process->pid, "cups-driverd", helper_timeout(), NULL, NULL);
   logFromFile2(&logThread, errlog);
 
-  char ppdn[1024];
-  snprintf(ppdn, sizeof(ppdn), "%s-%s", make_and_model, device_uri);
-  escape_string(escp_model, ppdn, sizeof(ppdn));
-  char ppd_folder[2048];
-  snprintf(ppd_folder, sizeof(ppd_folder), "%s/ppd", tmpdir);
-  if (mkdir(ppd_folder, 0777) == -1 && errno != EEXIST)
-    debug_printf("ERROR: Cannot create directory %s: %s\n",
-		 ppd_folder, strerror(errno));
-  snprintf(ppd_name, sizeof(ppd_name), "%s/ppd/%s.ppd", tmpdir, escp_model);
-  cups_file_t* tempPPD;
-  if ((tempPPD = cupsFileOpen(ppd_name, "w")) == NULL) {
-    debug_printf("ERROR: Cannot create temporary PPD!\n");
-    free(process);
-    return (-1);
-  }
-  int counter = print_ppd(process,tempPPD);
+  ssize_t size = save_ppd(process, ppd_name);
 
-  if ((process_pid = waitpid(process->pid, &status, 0)) > 0) {
-#if 0
-    if (WIFEXITED(status)) {
-      int st =0,counter=0;
-      counter = print_ppd(process,tempPPD);
-      /*while((st = print_ppd(process, tempPPD)) > 0) counter++;*/
-    }
-#endif
-    pthread_join(logThread, NULL);
-  }
+  process_pid = supervise_wait(process->pid, &status);
+  pthread_join(logThread, NULL);
 
-  cupsFileClose(tempPPD);
   free(process);
+  if (size >= 0 && (process_pid <= 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))) {
+    unlink(ppd_name);  /* May have been cut short */
+    size = -1;
+  }
+  if (size < 0)
+    return (-1);
+  ppd_store_add(ppd_uri, ppd_name);
+  ppd_cache_put(make_and_model, device_id, ppd_uri);
   strncpy(ppd, ppd_name, ppd_len);
   return 0;
 }
 
-int get_ppd_uri(char* ppd_uri, process_t* backend) {
+int get_ppd_uri(char* ppd_uri, size_t len, process_t* backend) {
   char line[2048];
+  int ret = 1;
 
   if (cupsFileGets(backend->pipe, line, sizeof(line))) {
-    sscanf(line, "%s", ppd_uri);
-    cupsFileClose(backend->pipe);
-    return 0;
+    line[strcspn(line, " \t")] = '\0';  /* The PPD URI is the first word */
+    if (!line[0] || strlcpy(ppd_uri, line, len) >= len)
+      debug_printf("ERROR: Bad PPD URI from cups-driverd: %s\n", line);
+    else
+      ret = 0;
   }
   cupsFileClose(backend->pipe);
-  return 1;
+  return ret;
 }
 
-int print_ppd(process_t* backend, cups_file_t *temp) {
-  int counter = 0;
-  char line[2048];
+/*
+ * write_all() - write() all of buf, across partial writes.
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+  ssize_t bytes;
+
+  while (len > 0) {
+    if ((bytes = write(fd, buf, len)) < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    buf += bytes;
+    len -= bytes;
+  }
+  return 0;
+}
 
-  while (cupsFileGets(backend->pipe, line, sizeof(line))) {
-    cupsFilePrintf(temp, "%s\n", line);
-    counter++;
+/*
+ * save_ppd() - Store the PPD cups-driverd writes to backend->pipe as ppd.
+ * The raw bytes are moved from the pipe with splice(), or with read() and
+ * write() where the kernel cannot splice into the file, into a temporary
+ * file which replaces ppd once the PPD is complete.
+ * Returns -
+ * -1 - Error or empty PPD, ppd was not touched
+ * else Size of the PPD
+ */
+ssize_t save_ppd(process_t *backend, const char *ppd) {
+  char temp[1024], buf[65536];
+  ssize_t bytes, total = 0;
+  int in = cupsFileNumber(backend->pipe), out, use_splice = 1;
+
+  snprintf(temp, sizeof(temp), "%s.XXXXXX", ppd);
+  if ((out = mkostemp(temp, O_CLOEXEC)) < 0) {
+    debug_printf("ERROR: Cannot create temporary PPD %s: %s\n", temp,
+		 strerror(errno));
+    cupsFileClose(backend->pipe);
+    return -1;
+  }
+  fchmod(out, 0644);
+
+  for (;;) {
+    if (use_splice) {
+      bytes = splice(in, NULL, out, NULL, sizeof(buf) * 16,
+		     SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (bytes < 0 && !total && (errno == EINVAL || errno == ENOSYS)) {
+	use_splice = 0;
+	continue;
+      }
+    } else if ((bytes = read(in, buf, sizeof(buf))) > 0 &&
+	       write_all(out, buf, bytes))
+      bytes = -1;
+    if (bytes < 0 && errno == EINTR)
+      continue;
+    if (bytes <= 0)
+      break;
+    total += bytes;
   }
+  if (bytes < 0)
+    debug_printf("ERROR: Cannot write PPD %s: %s\n", temp, strerror(errno));
   cupsFileClose(backend->pipe);
-  return counter;
+
+  if (close(out) || bytes < 0 || !total || rename(temp, ppd)) {
+    unlink(temp);
+    return -1;
+  }
+  return total;
 }
 
+/*
+ * remove_ppd() - Drop the PPD of a removed printer. The PPD itself stays
+ * in the store for other printers of the model.
+ */
 int remove_ppd(char* ppd) {
-  return unlink(ppd);
+  int users;
+
+  if ((users = ppd_store_release(ppd)) < 0)
+    return -1;
+  debug_printf("DEBUG2: %s removed, %d other printers use its PPD\n", ppd,
+	       users);
+  return 0;
 }
 
+/*
+ * eve_done() - Supervisor callback of an ippeveprinter, whether it was
+ * stopped or exited on its own: its port (data) is free again.
+ */
+static void eve_done(pid_t pid, int status, void *data) {
+  port_release((int)(intptr_t)data);
+}
+
+/*
+ * start_ippeveprinter() - Bring up the printer dev. Only called from the
+ * main thread, as ippeveprinter is spawned with CUPSD_SPAWN_PDEATHSIG.
+ */
 int start_ippeveprinter(device_t *dev) {
-  pid_t pid = 0, ppid = 0;
-  ppid = getpid();
+  pid_t pid;
   int pfd[2];
-
-  if (pipe(pfd))
-    return -1;
-
-  if (fcntl(pfd[0], F_SETFD, fcntl(pfd[0], F_GETFD) | FD_CLOEXEC)) {
-    close(pfd[0]);
-    close(pfd[1]);
+  char *argv[17];
+  char name[2048], device_uri[2048], ppd[1024], make_and_model[512],
+       command[1024], pport[8], location[3096], service_name[1024],
+    package[64], identifier[256], backend[32], serial[64], pdls[2048];
+  char datadir[1024], serverdir[1024], cachedir[1024], cmdline[2048],
+       uri_var[2100], printer_var[600];
+  const char *vars[6];
+  char **envp = NULL;
+  char *p, *q, *r, *s;
+  char *field[] = {"SN", "SERN", "serial", "hostname", "ip", NULL};
+  int i, len, listen_fd;
+
+  if(dev == NULL)
     return -1;
-  }
-
-  if (fcntl(pfd[1], F_SETFD, fcntl(pfd[1], F_GETFD) | FD_CLOEXEC)) {
-    close(pfd[0]);
-    close(pfd[1]);
+  snprintf(datadir, sizeof(datadir), "CUPS_DATADIR=%s%s", snap, DATADIR);
+  snprintf(serverdir, sizeof(serverdir), "CUPS_SERVERBIN=%s%s", snap,
+	   SERVERBIN);
+  snprintf(cachedir, sizeof(cachedir), "CUPS_CACHEDIR=%s", tmpdir);
+
+  snprintf(name, sizeof(name), "%s%s/ippeveprinter", snap, BINDIR);
+  if(dev->device_uri)
+    snprintf(device_uri, sizeof(device_uri), "\"%s\"", dev->device_uri);
+  if(dev->ppd)
+    snprintf(ppd, sizeof(ppd), "%s", dev->ppd);
+  /* With socket activation ippeveprinter gets the bound socket */
+  listen_fd = -1;
+  if ((dev->port = port_lease(dev->device_uri, port_socket_activation() ?
+			       &listen_fd : NULL)) < 0)
     return -1;
-  }
+  snprintf(pport, sizeof(pport), "%d", dev->port);
 
-  if ((pid = fork()) < 0) {
-    close(pfd[0]);
-    close(pfd[1]);
-    return -1;
-  } else if (pid == 0) {
-    int status = 0;
-    if ((status = prctl(PR_SET_PDEATHSIG, SIGTERM)) < 0) {
-      perror(0);    /* Unable to set prctl */
-      exit(1);
-    }
-    if(getppid() != ppid)
-      exit(0);      /* Parent as exited already! */
-
-    char *argv[17];
-    char name[2048], device_uri[2048], ppd[1024], make_and_model[512],
-         command[1024], pport[8], location[3096], service_name[1024],
-      package[64], identifier[256], backend[32], serial[64], pdls[2048];
-    char datadir[1024], serverdir[1024], cachedir[1024], cmdline[2048];
-    char *envp[2];
-    char LD_PATH[512];
-    char *p, *q, *r, *s;
-    char *field[] = {"SN", "SERN", "serial", "hostname", "ip", NULL};
-    int i, len;
-
-    snprintf(datadir, sizeof(datadir), "%s%s", snap, DATADIR);
-    snprintf(serverdir, sizeof(serverdir), "%s%s", snap, SERVERBIN);
-    snprintf(cachedir, sizeof(cachedir), "%s", tmpdir);
-
-    setenv("CUPS_DATADIR", datadir, 1);
-    setenv("CUPS_SERVERBIN", serverdir, 1);
-    setenv("CUPS_CACHEDIR", cachedir, 1);
-
-    snprintf(name, sizeof(name), "%s%s/ippeveprinter", snap, BINDIR);
-    if(dev == NULL)
-      exit(1);
-    if(dev->device_uri)
-      snprintf(device_uri, sizeof(device_uri), "\"%s\"", dev->device_uri);
-    if(dev->ppd)
-      snprintf(ppd, sizeof(ppd), "%s", dev->ppd);
-    snprintf(pport, sizeof(pport), "%d", getport());
-
-    p = getenv("BINDIR");
-    if (p)
-      snprintf(command, sizeof(command), "%s/ippprint", p);
-    else
-      snprintf(command, sizeof(command), "%s%s/ippprint", snap, BINDIR);
+  p = getenv("BINDIR");
+  if (p)
+    snprintf(command, sizeof(command), "%s/ippprint", p);
+  else
+    snprintf(command, sizeof(command), "%s%s/ippprint", snap, BINDIR);
 
-    p = getenv("PDLS");
-    if (p)
-      strlcpy(pdls, p, sizeof(pdls));
-    else
-      pdls[0] = '\0';
+  p = getenv("PDLS");
+  if (p)
+    strlcpy(pdls, p, sizeof(pdls));
+  else
+    pdls[0] = '\0';
 
-    /* Make the service name of our IPP printer emulation unique for the case
-       that we have multiple printers of the same model */
-    p = getenv("PACKAGENAME");
-    if (p)
-      snprintf(package, sizeof(package), "%s, ", p);
-    else
-      package[0] = '\0';
-
-    service_name[0] = '\0';
-    s = strchr(dev->device_uri, ':');
-    strlcpy(backend, dev->device_uri, s - dev->device_uri + 1);
-    for (i = 0; i < strlen(backend); i ++)
-      backend[i] = toupper(backend[i]);
-    serial[0] = '\0';
-    if ((q = strchr(dev->device_info, '[')) && (r = strchr(q, ']'))
-	&& (len = r - q - 1) > 0)
-      strlcpy(serial, q + 1, len + 1);
-    if (serial[0] == '\0')
-      for (i = 0; ; i ++) {
-	p = field[i];
-	if (p == NULL) break;
-	if ((q = strcasestr(dev->device_uri, p)) != NULL &&
-	    (q == dev->device_uri || *(q - 1) == '?' ||  *(q - 1) == '&') &&
-	    (*(q + strlen(p)) == '=')) {
-	  q += strlen(p) + 1;
-	  len = 0;
-	  if ((r = strchr(q, '&')) || (len = strlen(q))) {
-	    if (r) len = r - q;
-	    if (len > sizeof(serial) - 1)
-	      strlcpy(serial, q, sizeof(serial));
-	    else
-	      strlcpy(serial, q, len + 1);
-	    break;
-	  }
+  /* Make the service name of our IPP printer emulation unique for the case
+     that we have multiple printers of the same model */
+  p = getenv("PACKAGENAME");
+  if (p)
+    snprintf(package, sizeof(package), "%s, ", p);
+  else
+    package[0] = '\0';
+
+  service_name[0] = '\0';
+  s = strchr(dev->device_uri, ':');
+  strlcpy(backend, dev->device_uri, s - dev->device_uri + 1);
+  for (i = 0; i < strlen(backend); i ++)
+    backend[i] = toupper(backend[i]);
+  serial[0] = '\0';
+  if ((q = strchr(dev->device_info, '[')) && (r = strchr(q, ']'))
+      && (len = r - q - 1) > 0)
+    strlcpy(serial, q + 1, len + 1);
+  if (serial[0] == '\0')
+    for (i = 0; ; i ++) {
+      p = field[i];
+      if (p == NULL) break;
+      if ((q = strcasestr(dev->device_uri, p)) != NULL &&
+	  (q == dev->device_uri || *(q - 1) == '?' ||  *(q - 1) == '&') &&
+	  (*(q + strlen(p)) == '=')) {
+	q += strlen(p) + 1;
+	len = 0;
+	if ((r = strchr(q, '&')) || (len = strlen(q))) {
+	  if (r) len = r - q;
+	  if (len > sizeof(serial) - 1)
+	    strlcpy(serial, q, sizeof(serial));
+	  else
+	    strlcpy(serial, q, len + 1);
+	  break;
 	}
       }
-    if (serial[0] == '\0')
-      for (i = 0; ; i ++) {
-	p = field[i];
-	if (p == NULL) break;
-	if ((q = strcasestr(dev->device_id, p)) != NULL &&
-	    (q == dev->device_id || *(q - 1) == ';') &&
-	    (*(q + strlen(p)) == ':')) {
-	  q += strlen(p) + 1;
-	  len = 0;
-	  if ((r = strchr(q, ';')) || (len = strlen(q))) {
-	    if (r) len = r - q;
-	    if (len > sizeof(serial) - 1)
-	      strlcpy(serial, q, sizeof(serial));
-	    else
-	      strlcpy(serial, q, len + 1);
-	    break;
-	  }
+    }
+  if (serial[0] == '\0')
+    for (i = 0; ; i ++) {
+      p = field[i];
+      if (p == NULL) break;
+      if ((q = strcasestr(dev->device_id, p)) != NULL &&
+	  (q == dev->device_id || *(q - 1) == ';') &&
+	  (*(q + strlen(p)) == ':')) {
+	q += strlen(p) + 1;
+	len = 0;
+	if ((r = strchr(q, ';')) || (len = strlen(q))) {
+	  if (r) len = r - q;
+	  if (len > sizeof(serial) - 1)
+	    strlcpy(serial, q, sizeof(serial));
+	  else
+	    strlcpy(serial, q, len + 1);
+	  break;
 	}
       }
-    snprintf(identifier, sizeof(identifier), " (%s%s%s%s)", package, backend,
-	     serial[0] ? ", " : "", serial);
-    strlcpy(service_name, dev->device_make_and_model, sizeof(service_name));
-    if (63 - strlen(service_name) < strlen(identifier))
-      r = service_name + 63 - strlen(identifier);
-    else
-      r = service_name + strlen(service_name);
-    strlcpy(r, identifier, strlen(identifier) + 1);
-    service_name[63] = '\0';
-
-    snprintf(location, sizeof(location),
-	     "Printer Application, Original Device Info: %s",
-	     dev->device_info);
-
-    setenv("DEVICE_URI", device_uri, 1);
-    setenv("PRINTER", dev->device_make_and_model, 1);
-
-    char printer_name[512];
-    char scheme[10];
-    getBackend(dev->device_uri, scheme, sizeof(scheme));
-    snprintf(printer_name, sizeof(printer_name), "%s",
-	     dev->device_make_and_model);
-    printer_name[sizeof(printer_name) - 1] = 0;
-    escape_string(make_and_model, printer_name, sizeof(printer_name));
-    i = 0;
-    argv[i++] = (char*)name;
-    argv[i++] = "-P";
-    argv[i++] = (char*)ppd;
-    argv[i++] = "-c";
-    argv[i++] = (char*)command;
-    if (pdls[0]) {
-      argv[i++] = "-f";
-      argv[i++] = (char*)pdls;
     }
-    argv[i++] = "-p";
-    argv[i++] = (char*)pport;
-    argv[i++] = "-l";
-    argv[i++] = (char*)location;
+  snprintf(identifier, sizeof(identifier), " (%s%s%s%s)", package, backend,
+	   serial[0] ? ", " : "", serial);
+  strlcpy(service_name, dev->device_make_and_model, sizeof(service_name));
+  if (63 - strlen(service_name) < strlen(identifier))
+    r = service_name + 63 - strlen(identifier);
+  else
+    r = service_name + strlen(service_name);
+  strlcpy(r, identifier, strlen(identifier) + 1);
+  service_name[63] = '\0';
+
+  snprintf(location, sizeof(location),
+	   "Printer Application, Original Device Info: %s",
+	   dev->device_info);
+
+  snprintf(uri_var, sizeof(uri_var), "DEVICE_URI=%s", device_uri);
+  snprintf(printer_var, sizeof(printer_var), "PRINTER=%s",
+	   dev->device_make_and_model);
+  vars[0] = datadir;
+  vars[1] = serverdir;
+  vars[2] = cachedir;
+  vars[3] = uri_var;
+  vars[4] = printer_var;
+  vars[5] = NULL;
+
+  char printer_name[512];
+  char scheme[10];
+  getBackend(dev->device_uri, scheme, sizeof(scheme));
+  snprintf(printer_name, sizeof(printer_name), "%s",
+	   dev->device_make_and_model);
+  printer_name[sizeof(printer_name) - 1] = 0;
+  escape_string(make_and_model, printer_name, sizeof(printer_name));
+  i = 0;
+  argv[i++] = (char*)name;
+  argv[i++] = "-P";
+  argv[i++] = (char*)ppd;
+  argv[i++] = "-c";
+  argv[i++] = (char*)command;
+  if (pdls[0]) {
+    argv[i++] = "-f";
+    argv[i++] = (char*)pdls;
+  }
+  argv[i++] = "-p";
+  argv[i++] = (char*)pport;
+  argv[i++] = "-l";
+  argv[i++] = (char*)location;
 #if 0
-    argv[i++] = "-K";
-    argv[i++] = (char*)tmpdir;
-    argv[i++] = "-n";
-    argv[i++] = strdup("localhost");
+  argv[i++] = "-K";
+  argv[i++] = (char*)tmpdir;
+  argv[i++] = "-n";
+  argv[i++] = strdup("localhost");
 #endif
-    argv[i++] = (char*)service_name;
-    argv[i++] = NULL;
-
-    char *logdir = logdirname();
-    /*dup2(1, 2);*/
-    char printerlogs[1024];
-    snprintf(printerlogs, sizeof(printerlogs), "%s/printer.logs", logdir);
-    /*int logfd = open(printerlogs, O_CREAT,
-		     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    close(logfd);
-    logfd = open(printerlogs, O_WRONLY | O_APPEND);*/
-    strlcpy(cmdline, "DEBUG: Launching IPP printer emulator: ", sizeof(cmdline));
-    p = cmdline + strlen(cmdline);
-    q = cmdline + sizeof(cmdline) - 1;
-    for (i = 0; ; i++) {
-      if (argv[i] == NULL || p >= q) break;
-      if (strchr(argv[i], ' ') || strchr(argv[i], '\t')) {
-	*p = '\'';
-	p++;
-      }
-      if (strlen(argv[i]) > q - p) {
-	strlcpy(p, argv[i], q-p);
-	break;
-      } else {
-	strlcpy(p, argv[i], strlen(argv[i]) + 1);
-	p += strlen(argv[i]);
-      }
-      if (p >= q) break;
-      if (strchr(argv[i], ' ') || strchr(argv[i], '\t')) {
-	*p = '\'';
-	p++;
-      }
-      if (p >= q) break;
-      *p = ' ';
+  argv[i++] = (char*)service_name;
+  argv[i++] = NULL;
+
+  char *logdir = logdirname();
+  /*dup2(1, 2);*/
+  char printerlogs[1024];
+  snprintf(printerlogs, sizeof(printerlogs), "%s/printer.logs", logdir);
+  free(logdir);
+  /*int logfd = open(printerlogs, O_CREAT,
+		   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  close(logfd);
+  logfd = open(printerlogs, O_WRONLY | O_APPEND);*/
+  strlcpy(cmdline, "DEBUG: Launching IPP printer emulator: ", sizeof(cmdline));
+  p = cmdline + strlen(cmdline);
+  q = cmdline + sizeof(cmdline) - 1;
+  for (i = 0; ; i++) {
+    if (argv[i] == NULL || p >= q) break;
+    if (strchr(argv[i], ' ') || strchr(argv[i], '\t')) {
+      *p = '\'';
       p++;
     }
-    *p = '\0';
-    debug_printf("%s\n", cmdline);
-    /*if (logfd > 0) {
-      dup2(logfd, 2);
-      dup2(logfd, 1);
-      close(logfd);
-      }*/
-    dup2(pfd[1], 2);
-    dup2(pfd[1], 1);
-    close(pfd[1]);
-
-    execvp(argv[0], argv);
-    exit(0);
+    if (strlen(argv[i]) > q - p) {
+      strlcpy(p, argv[i], q-p);
+      break;
+    } else {
+      strlcpy(p, argv[i], strlen(argv[i]) + 1);
+      p += strlen(argv[i]);
+    }
+    if (p >= q) break;
+    if (strchr(argv[i], ' ') || strchr(argv[i], '\t')) {
+      *p = '\'';
+      p++;
+    }
+    if (p >= q) break;
+    *p = ' ';
+    p++;
   }
+  *p = '\0';
+  debug_printf("%s\n", cmdline);
+  /*if (logfd > 0) {
+    dup2(logfd, 2);
+    dup2(logfd, 1);
+    close(logfd);
+    }*/
 
+  if (pipe2(pfd, O_CLOEXEC))
+    pfd[0] = pfd[1] = pid = -1;
+  else if ((envp = cupsdSpawnEnv(vars)) == NULL)
+    pid = -1;
+  else
+    pid = cupsdSpawn(name, argv, envp, pfd[1], pfd[1], listen_fd,
+		     CUPSD_SPAWN_PDEATHSIG);
+  free(envp);
+  if (listen_fd >= 0)
+    close(listen_fd);
+  if (pid < 0) {
+    debug_printf("ERROR: Unable to launch %s: %s\n", name, strerror(errno));
+    if (pfd[0] >= 0) {
+      close(pfd[0]);
+      close(pfd[1]);
+    }
+    port_release(dev->port);
+    return -1;
+  }
   close(pfd[1]);
-  logFromFd(&(dev->errlog), pfd[0]);
 
-  if (dev)
-    dev->eve_pid = pid;
+  if (supervise(pid, "ippeveprinter", 0, eve_done,
+		(void *)(intptr_t)dev->port)) {
+    debug_printf("ERROR: Unable to supervise %s, stopping it\n", name);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(pfd[0]);
+    port_release(dev->port);
+    return -1;
+  }
+  logFromFd(&(dev->errlog), pfd[0]);
+  dev->eve_pid = pid;
 
   return pid;
 }
 
-int getport() {
-  int port = 8000;
-
-  for (; port < 9000; port++) {
-    int sd = 0;
-    sd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sd < 0)
-      continue;
-    int true = 1;
-    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &true, sizeof(int));
-    struct sockaddr_in server;
-    memset(&server, 0, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server.sin_port = htons(port);
-    int t;
-    if ((t = bind(sd, (struct sockaddr*)&server,
-		  sizeof(struct sockaddr))) >= 0) {
-      /*fprintf(stderr, "IN: %d %d\n", sd, t);*/
-      close(sd);
-      break;
-    }
-    close(sd);
-    /*fprintf(stderr, "%d %d\n", sd, t);*/
-  }
-  return port;
-}
-
 static int kill_ippeveprinter(pid_t pid) {
   int status;
 
   if (pid > 0) {
     debug_printf("DEBUG: Killing ippeveprinter: %d\n", pid);
-    kill(pid, SIGINT);
-    if (waitpid(pid, &status, 0) < 0) {
+    /* SIGTERM and SIGKILL follow if it does not shut down in time */
+    if (supervise_kill(pid, SIGINT, KILL_TIMEOUT))
+      return 0;                 /* Exited on its own, eve_done() ran */
+    if (supervise_wait(pid, &status) < 0 && errno != ECHILD) {
       debug_printf("ERROR: WAITPID Error!\n");
       return -1;
     }
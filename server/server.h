@@ -20,6 +20,8 @@
 #include <cups/file.h>
 #include <cups/array.h>
 #include "util.h"
+#include "event.h"
+#include "device_line.h"
 #include <time.h>
 #include <sys/wait.h>
 #include <signal.h>
@@ -33,12 +35,16 @@
 #define DEVICED_USE "1"
 #define DEVICED_OPT "\"\""
 
+#define PPD_WORKERS 4       /* Default PPD_WORKERS, see add_devices() */
+#define MAX_PPD_WORKERS 16
+
 #define SUBSYSTEM "usb"
 
 typedef struct {
   char name[1024];
   int pid, status;
   cups_file_t *pipe;
+  int records;      /* Output is binary device records (deviced -b) */
 } process_t;
 
 typedef struct {
@@ -49,7 +55,10 @@ typedef struct {
        device_make_and_model[512],
        device_id[2048];
   char ppd[1024];
+  char backend[32];   /* Backend which reported the device, if known */
+  int latency;        /* ms until it was reported, -1 if unknown */
   int eve_pid;
+  int port;           /* IPP port of ippeveprinter, see port_lease() */
   pthread_t errlog;
 } device_t;
 
@@ -70,13 +79,25 @@ enum child_signal {
 char *snap;
 char *tmpdir; /* SNAP_COMMON */
 
-int pending_signals[2 * NUM_SIGNALS + 1];
-pthread_mutex_t signal_lock;
+/*
+ * Default debounce windows (milliseconds). Events of a subsystem are merged
+ * until it has been quiet for this long, or for at most
+ * DEBOUNCE_MAX_FACTOR windows after the first event of a burst.
+ */
+#define DEBOUNCE_DNSSD 1000
+#define DEBOUNCE_USB 500
+#define DEBOUNCE_SERIAL 500
+#define DEBOUNCE_PARALLEL 500
+#define DEBOUNCE_MAX_FACTOR 4
+
 typedef struct {
-  time_t signal_time;
-  int val;
+  double signal_time;   /* Time of the latest event (event_now()) */
+  double first_time;    /* Time of the first event of the burst */
+  int val;              /* Number of events in the burst */
 } signal_data_t;
 
+signal_data_t pending_signals[2 * NUM_SIGNALS + 1]; /* Main loop only */
+
 cups_array_t *con_devices;
 cups_array_t *temp_devices;
 void* start_hardware_monitor(void *n);
@@ -88,32 +109,36 @@ pthread_t avahiThread;
 
 void cleanup();
 int parse_line(process_t*);
-static int		process_device(const char *device_class,
+int		process_device(const char *device_class,
 				       const char *device_make_and_model,
 				       const char *device_info,
 				       const char *device_uri,
 				       const char *device_id,
 				       const char *device_location);
+int process_device_line(const device_line_t *line);
 
 static int get_ppd(char* ppd, int ppd_len, char *make_and_model, int make_len,
 		   char *device_id, int dev_len, char* device_uri);
-int get_ppd_uri(char* ppd_uri, process_t* process);
-int print_ppd(process_t* backend, cups_file_t* tempPPD);
+int get_ppd_uri(char* ppd_uri, size_t len, process_t* process);
+ssize_t save_ppd(process_t* backend, const char *ppd);
 
 int compare_devices(device_t *d0, device_t *d1);
 int monitor_devices(pid_t ppid);
 int get_devices(int insert, int signal);
+int find_devices(int insert, int signal, const char *wanted);
 device_t* deviceCopy(device_t *in);
 
 #ifdef HAVE_AVAHI
 int monitor_avahi_devices(pid_t ppid);
 void* start_avahi_monitor(void *n);
 #endif
-void add_devices(cups_array_t *con, cups_array_t *temp);
-void remove_devices(cups_array_t *con, cups_array_t *temp, char *includes);
+int add_devices(cups_array_t *con, cups_array_t *temp);
+char **driverd_env(void);
+void prefetch_ppds(cups_array_t *guesses);
+void prefetch_wait(void);
+int remove_devices(cups_array_t *con, cups_array_t *temp, char *includes);
 int remove_ppd(char* ppd);
 int start_ippeveprinter(device_t *dev);
-int getport();
 static int kill_ippeveprinter(pid_t pid);
 int kill_listeners();
 void cleanup();
@@ -1,6 +1,54 @@
 #include "server.h"
+#include "probe.h"
 #include <sys/socket.h>
 
+/*
+ * Full rescans run every RESCAN_MIN_INTERVAL seconds after the inventory
+ * changed, and back off by RESCAN_BACKOFF up to RESCAN_MAX_INTERVAL while
+ * rescans find nothing new.
+ */
+#define RESCAN_MIN_INTERVAL 10
+#define RESCAN_MAX_INTERVAL 300
+#define RESCAN_BACKOFF 2
+
+/*
+ * Configuration keys which are handed to the server (and its children)
+ * as environment variables.
+ */
+static const char *config_env[][2] = {
+  {"DebounceNetwork", "DEBOUNCE_DNSSD"},
+  {"DebounceUSB", "DEBOUNCE_USB"},
+  {"DebounceSerial", "DEBOUNCE_SERIAL"},
+  {"DebounceParallel", "DEBOUNCE_PARALLEL"},
+  {"RescanMinInterval", "RESCAN_MIN_INTERVAL"},
+  {"RescanMaxInterval", "RESCAN_MAX_INTERVAL"},
+  {"RescanBackoff", "RESCAN_BACKOFF"},
+  {"UsbAllowList", "USB_ALLOW_LIST"},
+  {"UsbDenyList", "USB_DENY_LIST"},
+  {"BackendCacheTTL", "DEVICED_CACHE_TTL"},
+  {"BackendTransports", "BACKEND_TRANSPORTS"},
+  {"PpdNegativeTTL", "PPD_NEGATIVE_TTL"},
+  {"PpdWorkers", "PPD_WORKERS"},
+  {"HelperTimeout", "HELPER_TIMEOUT"},
+  {"IppSocketActivation", "IPP_SOCKET_ACTIVATION"},
+  {NULL, NULL}
+};
+
+static int debounce[NUM_SIGNALS]; /* Debounce window of each subsystem (ms) */
+
+typedef struct {
+  int min_interval,     /* Interval after churn (seconds) */
+      max_interval,     /* Interval when the inventory is stable */
+      backoff,          /* Growth factor after a scan without changes */
+      interval;         /* Current interval */
+  double next;          /* Time of the next full rescan (event_now()) */
+} rescan_t;
+
+static rescan_t rescan;
+
+static cups_array_t *usb_adds;  /* sysfs paths of hot-plugged USB devices */
+static int usb_adds_full = 0;   /* Some USB add event has no sysfs path */
+
 void initialize() {
   char filename[PATH_MAX];
   snprintf(filename, PATH_MAX - 1, "%s/%s/framework.config",
@@ -11,9 +59,6 @@ void initialize() {
     return;
   }
   char line[2048];
-  int maxLines = 20;
-  char lines[maxLines][2][1024];
-  int numLines = 0;
   while (cupsFileGets(config, line, sizeof(line))) {
     int len = strlen(line);
     int comment = 0;
@@ -33,7 +78,8 @@ void initialize() {
     int index=0;
     int numTokens=0;
     for (int i = 0; i <= len; i++) {
-      if (isalnum(line[i]) && index < 1024)
+      if ((isalnum(line[i]) || (numTokens && line[i] && !isspace(line[i])))
+	  && index < 1023)
         temp[index++] = line[i];
       else {
         if (index) {
@@ -46,25 +92,147 @@ void initialize() {
         }
       }
     }
-    if (numTokens == 2) {
-      strcpy(lines[numLines][0], tokens[0]);
-      strcpy(lines[numLines][1], tokens[1]);
-      numLines++;
-      if(numLines >= maxLines)
-        break;
-    }
-  }
-  cupsFileClose(config);
-  for (int i = 0; i < numLines; i++) {
-    /*fprintf(stderr, "Lines: %d %s %s\n", i, lines[i][0], lines[i][1]);*/
-    if (!strcmp(lines[i][0], "DebuggingLevel")) {
+    if (numTokens != 2)
+      continue;
+    /* Applied as they are read, any number of keys */
+    if (!strcmp(tokens[0], "DebuggingLevel")) {
       char level[2] = "1";
-      if (!strncasecmp(lines[i][1], "DEBUG2", 6))
+      if (!strncasecmp(tokens[1], "DEBUG2", 6))
         level[0] = '3';
-      else if(!strncasecmp(lines[i][1],"DEBUG",5))
+      else if(!strncasecmp(tokens[1],"DEBUG",5))
         level[0] = '2';
       setenv("DEBUG_LEVEL", level, 1);
     }
+    for (int j = 0; config_env[j][0]; j++)
+      if (!strcmp(tokens[0], config_env[j][0]))
+	setenv(config_env[j][1], tokens[1], 1);
+  }
+  cupsFileClose(config);
+}
+
+/*
+ * ready_in() - Milliseconds until the burst in pending_signals[i] may be
+ * handled, 0 if it can be handled now, -1 if nothing is pending.
+ */
+static int ready_in(int i, double now) {
+  signal_data_t *sig = pending_signals + i;
+  double window = debounce[(i - 1) / 2] / 1000.0, due;
+
+  if (!sig->val)
+    return -1;
+  due = sig->signal_time + window;
+  if (due > sig->first_time + DEBOUNCE_MAX_FACTOR * window)
+    due = sig->first_time + DEBOUNCE_MAX_FACTOR * window;
+  if (due <= now)
+    return 0;
+  return (int)(1000 * (due - now)) + 1;
+}
+
+/*
+ * add_signal() - Account an event of signal i received at time t.
+ */
+static void add_signal(int i, double t) {
+  signal_data_t *sig = pending_signals + i;
+
+  if (!sig->val)
+    sig->first_time = t;
+  sig->signal_time = t;
+  sig->val ++;
+}
+
+/*
+ * collect_events() - Drain the hotplug event queue into pending_signals.
+ */
+static void collect_events(void) {
+  hotplug_event_t event;
+
+  while (event_pop(&event)) {
+    debug_printf("DEBUG2: Event %llu: signal %d %s %s %s\n", event.seqnum,
+		 event.signal, event.subsystem, event.devnode, event.syspath);
+    if (event.signal > 0 && event.signal <= 2 * NUM_SIGNALS)
+      add_signal(event.signal, event.time);
+    if (event.signal == USB_ADD) {
+      if (event.syspath[0] && !strcmp(event.subsystem, "usb")) {
+	if (!cupsArrayFind(usb_adds, event.syspath))
+	  cupsArrayAdd(usb_adds, strdup(event.syspath));
+      } else
+	usb_adds_full = 1;
+    }
+  }
+  for (int i = 1; i <= 2 * NUM_SIGNALS; i++)
+    if (event_overflow(i)) {
+      debug_printf("DEBUG: Event queue overflow for signal %d\n", i);
+      add_signal(i, event_now());
+      if (i == USB_ADD)
+	usb_adds_full = 1;
+    }
+}
+
+/*
+ * scan_subsystem() - get_devices() for the subsystem of add signal i,
+ * taking local printers from sysfs where possible.
+ */
+static int scan_subsystem(int insert, int i) {
+  int changes;
+
+  if ((i == USB_ADD || i == PARALLEL_ADD) &&
+      (changes = probe_local_devices(insert, i)) >= 0)
+    return changes;
+  return get_devices(insert, insert ? i : i + 1);
+}
+
+/*
+ * handle_usb_adds() - Bring up the printers among the hot-plugged USB
+ * devices by probing just those devices. Falls back to a scan with the
+ * usb backends if some device cannot be resolved that way, which ends
+ * as soon as the backends reported the devices by their serial numbers,
+ * or to a full scan if removals are pending too (remove != 0), as only
+ * that sees those. The PPDs of the devices are prefetched from what udev
+ * knows while the backends run.
+ */
+static int handle_usb_adds(int remove) {
+  char *syspath, serials[1024];
+  int changes = -1,
+      targeted = !remove && !usb_adds_full && cupsArrayCount(usb_adds) > 0;
+
+  if (targeted)
+    changes = probe_usb_devices(usb_adds);
+  if (changes < 0)
+    probe_usb_prefetch(usb_adds);
+  if (changes < 0 && targeted &&
+      !probe_usb_serials(usb_adds, serials, sizeof(serials)))
+    changes = find_devices(1, USB_ADD, serials);
+  if (changes < 0)
+    changes = scan_subsystem(remove ? 2 : 1, USB_ADD);
+
+  while ((syspath = cupsArrayFirst(usb_adds)) != NULL) {
+    cupsArrayRemove(usb_adds, syspath);
+    free(syspath);
+  }
+  usb_adds_full = 0;
+  return changes;
+}
+
+/*
+ * rescan_update() - Schedule the next full rescan after a scan which
+ * changed the inventory by changes printers. full tells whether it was
+ * the full rescan itself or a hotplug scan.
+ */
+static void rescan_update(int changes, int full, double now) {
+  if (changes > 0) {
+    if (rescan.interval != rescan.min_interval)
+      debug_printf("DEBUG: Inventory changed, full rescan every %d seconds\n",
+		   rescan.min_interval);
+    rescan.interval = rescan.min_interval;
+    if (full || rescan.next > now + rescan.interval)
+      rescan.next = now + rescan.interval;
+  } else if (full) {
+    rescan.interval *= rescan.backoff;
+    if (rescan.interval > rescan.max_interval)
+      rescan.interval = rescan.max_interval;
+    rescan.next = now + rescan.interval;
+    debug_printf("DEBUG: Inventory stable, next full rescan in %d seconds\n",
+		 rescan.interval);
   }
 }
 
@@ -74,6 +242,7 @@ void initialize() {
 
 int main(int argc, char* argv[]) {
   pid_t pid, ppid;
+  double now;
 
   ppid = getpid();
 
@@ -97,17 +266,34 @@ int main(int argc, char* argv[]) {
 
   initialize();
   
+  usb_adds = cupsArrayNew((cups_array_func_t)strcmp, NULL);
   con_devices = cupsArrayNew((cups_array_func_t)compare_devices, NULL);
   temp_devices = cupsArrayNew((cups_array_func_t)compare_devices, NULL);
 
-  pending_signals[0] = 0;
+  debounce[0] = getenv_int("DEBOUNCE_DNSSD", DEBOUNCE_DNSSD);
+  debounce[1] = getenv_int("DEBOUNCE_USB", DEBOUNCE_USB);
+  debounce[2] = getenv_int("DEBOUNCE_SERIAL", DEBOUNCE_SERIAL);
+  debounce[3] = getenv_int("DEBOUNCE_PARALLEL", DEBOUNCE_PARALLEL);
+
+  rescan.min_interval = getenv_int("RESCAN_MIN_INTERVAL", RESCAN_MIN_INTERVAL);
+  rescan.max_interval = getenv_int("RESCAN_MAX_INTERVAL", RESCAN_MAX_INTERVAL);
+  rescan.backoff = getenv_int("RESCAN_BACKOFF", RESCAN_BACKOFF);
+  if (rescan.min_interval < 1)
+    rescan.min_interval = 1;
+  if (rescan.max_interval < rescan.min_interval)
+    rescan.max_interval = rescan.min_interval;
+  if (rescan.backoff < 1)
+    rescan.backoff = 1;
+  rescan.interval = rescan.min_interval;
+  rescan.next = 0;
+
+  memset(pending_signals, 0, sizeof(pending_signals));
   for (int i = 1; i <= 2 * NUM_SIGNALS; i++)
-    pending_signals[i] = 1;
+    pending_signals[i].val = 1;
   
-  if (pthread_mutex_init(&signal_lock, NULL) != 0) {
-    printf("ERROR: Mutex init Failed\n");
-    return -1;
-  }
+  if (event_init())
+    debug_printf("ERROR: Unable to wait for hotplug events, falling back to "
+		 "polling!\n");
   
   pthread_create(&hardwareThread, NULL, start_hardware_monitor, NULL);
 #if HAVE_AVAHI
@@ -117,19 +303,50 @@ int main(int argc, char* argv[]) {
   /*kill_listeners();*/
 
   while (1) {            /*Infinite loop*/
-    for (int i = 1; i <= 2 * NUM_SIGNALS; i++) {
-      int exec = 0;
-      pthread_mutex_lock(&signal_lock);
-      if (pending_signals[i]) {
-        pending_signals[i] = 0;
-        exec = 1;
-      }
-      pthread_mutex_unlock(&signal_lock);
-      if(exec)
-        get_devices(i % 2, i);
+    int timeout = -1, wait, changes;
+
+    collect_events();
+
+    /* i is the add signal of a subsystem, i + 1 its remove signal */
+    for (int i = 1; i <= 2 * NUM_SIGNALS; i += 2) {
+      int add = 0, remove = 0;
+      now = event_now();
+      if ((wait = ready_in(i, now)) == 0) {
+	add = pending_signals[i].val;
+	pending_signals[i].val = 0;
+      } else if (wait > 0 && (timeout < 0 || wait < timeout))
+	timeout = wait;
+      if ((wait = ready_in(i + 1, now)) == 0) {
+	remove = pending_signals[i + 1].val;
+	pending_signals[i + 1].val = 0;
+      } else if (wait > 0 && (timeout < 0 || wait < timeout))
+	timeout = wait;
+      if (add + remove > 1)
+	debug_printf("DEBUG: Merged %d add and %d remove events of signal %d\n",
+		     add, remove, i);
+      if (add && remove && i == USB_ADD)
+	changes = handle_usb_adds(1);
+      else if (add && remove)
+	changes = scan_subsystem(2, i);  /* One scan for both directions */
+      else if (add && i == USB_ADD)
+	changes = handle_usb_adds(0);
+      else if (add)
+	changes = scan_subsystem(1, i);
+      else if (remove)
+	changes = scan_subsystem(0, i);
+      else
+	continue;
+      rescan_update(changes, 0, event_now());
+    }
+    if ((now = event_now()) >= rescan.next) {
+      changes = get_devices(2, 0);
+      now = event_now();
+      rescan_update(changes, 1, now);
     }
-    get_devices(2, 0);
-    sleep(10);
+    wait = (int)(1000 * (rescan.next - now)) + 1;
+    if (timeout < 0 || wait < timeout)
+      timeout = wait;
+    event_wait(timeout);  /* Sleep until a monitor wakes us */
   }
   cleanup();
   
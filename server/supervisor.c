@@ -0,0 +1,366 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Supervisor of the child processes of the server. A thread collects
+ *  every supervised child as soon as it exits, woken up by a pidfd of each
+ *  child (or polling them every SUPERVISE_TICK ms on kernels without
+ *  pidfds), so no other thread ever blocks in waitpid(). A child may be
+ *  given a deadline: once it passes, the child (its process group if it
+ *  leads one) gets SIGTERM and, if it is still there KILL_TIMEOUT seconds
+ *  later, SIGKILL, so a hung cups-driverd or backend holds up its caller
+ *  for a bounded time only.
+ *
+ *  A child is either collected by supervise_wait() or, if it was given a
+ *  callback, handed to that callback on the supervisor thread; then
+ *  supervise_wait() only waits until the callback returned.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#include "server.h"
+#include "supervisor.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#define HELPER_TIMEOUT 60  /* Default HELPER_TIMEOUT, seconds */
+#define SUPERVISE_TICK 250 /* Milliseconds between polls without pidfds */
+
+typedef struct {
+  pid_t pid;
+  char name[32];
+  int pidfd;              /* -1 without pidfds */
+  double deadline;        /* event_now() of the next signal, 0 for none */
+  int kills;              /* Signals sent past the deadline */
+  int done, status;       /* Collected, for supervise_wait() */
+  int waiting;            /* supervise_wait() frees it */
+  supervise_cb_t cb;
+  void *data;
+} child_t;
+
+static pthread_mutex_t sup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sup_cond = PTHREAD_COND_INITIALIZER;
+static child_t **children = NULL;
+static int num_children = 0, alloc_children = 0;
+static pid_t sup_pid = 0;       /* Process the supervisor thread runs in */
+static int sup_wakeup = -1;
+
+/*
+ * helper_timeout() - Seconds a deviced or cups-driverd run may take, from
+ * HELPER_TIMEOUT. 0 means no deadline.
+ */
+int helper_timeout(void) {
+  const char *p = getenv("HELPER_TIMEOUT");
+
+  return ((p && *p && atoi(p) >= 0) ? atoi(p) : HELPER_TIMEOUT);
+}
+
+static void wakeup_supervisor(void) {
+  uint64_t one = 1;
+
+  if (sup_wakeup >= 0 && write(sup_wakeup, &one, sizeof(one)) < 0 &&
+      errno != EAGAIN)
+    debug_printf("ERROR: Unable to wake up the supervisor: %s\n",
+		 strerror(errno));
+}
+
+static child_t *find_child(pid_t pid) {
+  for (int i = 0; i < num_children; i++)
+    if (children[i]->pid == pid)
+      return children[i];
+  return NULL;
+}
+
+static void remove_child(child_t *child) {
+  for (int i = 0; i < num_children; i++)
+    if (children[i] == child) {
+      children[i] = children[--num_children];
+      break;
+    }
+}
+
+/*
+ * collect_children() - Collect the children which exited, called with
+ * sup_lock held. Callbacks are called without it.
+ */
+static void collect_children(void) {
+  child_t *child;
+  pid_t ret;
+  int status;
+
+  for (int i = 0; i < num_children;) {
+    child = children[i];
+    if (child->done ||
+	(ret = waitpid(child->pid, &status, WNOHANG)) == 0) {
+      i++;
+      continue;
+    }
+    if (ret < 0) {
+      debug_printf("ERROR: Unable to collect %s (PID %d): %s\n", child->name,
+		   child->pid, strerror(errno));
+      status = -1;
+    } else if (WIFSIGNALED(status))
+      debug_printf("DEBUG: %s (PID %d) killed by signal %d\n", child->name,
+		   child->pid, WTERMSIG(status));
+    else if (WEXITSTATUS(status))
+      debug_printf("DEBUG: %s (PID %d) exited with status %d\n", child->name,
+		   child->pid, WEXITSTATUS(status));
+    if (child->pidfd >= 0)
+      close(child->pidfd);
+    child->pidfd = -1;
+    child->status = status;
+    child->done = 1;
+
+    if (!child->cb) {
+      pthread_cond_broadcast(&sup_cond);
+      i++;
+      continue;
+    }
+    pthread_mutex_unlock(&sup_lock);
+    (child->cb)(child->pid, status, child->data);
+    pthread_mutex_lock(&sup_lock);
+    child->cb = NULL;
+    if (child->waiting)
+      pthread_cond_broadcast(&sup_cond);
+    else {
+      remove_child(child);
+      free(child);
+    }
+    i = 0;                       /* The list may have changed meanwhile */
+  }
+}
+
+/*
+ * check_deadlines() - Signal the children past their deadline, called
+ * with sup_lock held.
+ * Returns the next deadline, 0 for none.
+ */
+static double check_deadlines(double now) {
+  double next = 0;
+  child_t *child;
+
+  for (int i = 0; i < num_children; i++) {
+    child = children[i];
+    if (child->done || !child->deadline)
+      continue;
+    if (child->deadline <= now) {
+      debug_printf("ERROR: %s (PID %d) did not finish in time, sending %s\n",
+		   child->name, child->pid, child->kills ? "SIGKILL" :
+		   "SIGTERM");
+      /* With the programs it started, which may hold its pipes open */
+      kill(getpgid(child->pid) == child->pid ? -child->pid : child->pid,
+	   child->kills ? SIGKILL : SIGTERM);
+      child->deadline = child->kills++ ? 0 : now + KILL_TIMEOUT;
+    }
+    if (child->deadline && (!next || child->deadline < next))
+      next = child->deadline;
+  }
+  return next;
+}
+
+static void *supervisor_thread(void *arg) {
+  struct pollfd *pfds = NULL, *temp;
+  int alloc_pfds = 0, num_pfds, timeout, polling;
+  double next;
+  uint64_t count;
+
+  pthread_mutex_lock(&sup_lock);
+  for (;;) {
+    collect_children();
+    next = check_deadlines(event_now());
+
+    if (alloc_pfds < num_children + 1 &&
+	(temp = realloc(pfds, (num_children + 16) * sizeof(*pfds))) != NULL) {
+      pfds = temp;
+      alloc_pfds = num_children + 16;
+    }
+    num_pfds = 0;
+    polling = !pfds;
+    if (pfds) {
+      pfds[num_pfds].fd = sup_wakeup;
+      pfds[num_pfds++].events = POLLIN;
+    }
+    for (int i = 0; i < num_children && pfds; i++) {
+      if (children[i]->done)
+	continue;
+      if (children[i]->pidfd < 0 || num_pfds == alloc_pfds)
+	polling = 1;
+      else {
+	pfds[num_pfds].fd = children[i]->pidfd;
+	pfds[num_pfds++].events = POLLIN;
+      }
+    }
+    timeout = next ? (int)((next - event_now()) * 1000) + 1 : -1;
+    if (next && timeout < 0)
+      timeout = 0;
+    if (polling && (timeout < 0 || timeout > SUPERVISE_TICK))
+      timeout = SUPERVISE_TICK;
+    pthread_mutex_unlock(&sup_lock);
+
+    poll(pfds, num_pfds, timeout);
+    while (read(sup_wakeup, &count, sizeof(count)) > 0);
+
+    pthread_mutex_lock(&sup_lock);
+  }
+  return NULL;
+}
+
+static void prepare_fork(void) {
+  pthread_mutex_lock(&sup_lock);
+}
+
+static void parent_fork(void) {
+  pthread_mutex_unlock(&sup_lock);
+}
+
+/*
+ * child_fork() - A forked child has no supervisor thread and none of our
+ * children, it starts its own supervisor when it needs one.
+ */
+static void child_fork(void) {
+  for (int i = 0; i < num_children; i++) {
+    if (children[i]->pidfd >= 0)
+      close(children[i]->pidfd);
+    free(children[i]);
+  }
+  num_children = 0;
+  if (sup_wakeup >= 0)
+    close(sup_wakeup);
+  sup_wakeup = -1;
+  sup_pid = 0;
+  pthread_mutex_unlock(&sup_lock);
+}
+
+/*
+ * start_supervisor() - Start the supervisor thread of this process, called
+ * with sup_lock held.
+ * Returns -
+ * -1 - Error
+ * 0  - Success
+ */
+static int start_supervisor(void) {
+  static int atfork = 0;
+  pthread_t thread;
+
+  if (sup_pid == getpid())
+    return 0;
+  if (!atfork++)
+    pthread_atfork(prepare_fork, parent_fork, child_fork);
+  if ((sup_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+    debug_printf("ERROR: Unable to create supervisor eventfd: %s\n",
+		 strerror(errno));
+    return -1;
+  }
+  if (pthread_create(&thread, NULL, supervisor_thread, NULL)) {
+    debug_printf("ERROR: Unable to start the supervisor thread!\n");
+    close(sup_wakeup);
+    sup_wakeup = -1;
+    return -1;
+  }
+  pthread_detach(thread);
+  sup_pid = getpid();
+  return 0;
+}
+
+/*
+ * supervise() - Have the supervisor collect the child pid, which gets
+ * timeout seconds (0 for no deadline) before it is signalled. Without cb
+ * the child must be collected with supervise_wait(), otherwise cb gets
+ * its status on the supervisor thread.
+ * Returns -
+ * -1 - Error, the caller has to collect the child itself
+ * 0  - Success
+ */
+int supervise(pid_t pid, const char *name, int timeout, supervise_cb_t cb,
+	      void *data) {
+  child_t *child, **temp;
+
+  if (pid <= 0 || (child = calloc(1, sizeof(child_t))) == NULL)
+    return -1;
+  child->pid = pid;
+  strlcpy(child->name, name, sizeof(child->name));
+#ifdef SYS_pidfd_open
+  child->pidfd = syscall(SYS_pidfd_open, pid, 0);
+#else
+  child->pidfd = -1;
+#endif
+  child->deadline = timeout > 0 ? event_now() + timeout : 0;
+  child->cb = cb;
+  child->data = data;
+
+  pthread_mutex_lock(&sup_lock);
+  if (!start_supervisor() && num_children == alloc_children &&
+      (temp = realloc(children, (alloc_children + 16) *
+		      sizeof(child_t*))) != NULL) {
+    children = temp;
+    alloc_children += 16;
+  }
+  if (sup_pid != getpid() || num_children == alloc_children) {
+    pthread_mutex_unlock(&sup_lock);
+    if (child->pidfd >= 0)
+      close(child->pidfd);
+    free(child);
+    return -1;
+  }
+  children[num_children++] = child;
+  pthread_mutex_unlock(&sup_lock);
+  wakeup_supervisor();
+  return 0;
+}
+
+/*
+ * supervise_kill() - Send sig to the supervised child pid if it is still
+ * running, and give it timeout seconds (0 to keep its deadline) before
+ * the supervisor sends SIGTERM and SIGKILL.
+ * Returns -
+ * -1 - pid is not supervised
+ * 0  - Success
+ */
+int supervise_kill(pid_t pid, int sig, int timeout) {
+  child_t *child;
+
+  pthread_mutex_lock(&sup_lock);
+  if (sup_pid != getpid() || (child = find_child(pid)) == NULL) {
+    pthread_mutex_unlock(&sup_lock);
+    return -1;
+  }
+  if (!child->done) {
+    kill(pid, sig);
+    if (timeout > 0)
+      child->deadline = event_now() + timeout;
+  }
+  pthread_mutex_unlock(&sup_lock);
+  wakeup_supervisor();
+  return 0;
+}
+
+/*
+ * supervise_wait() - Wait until the supervisor collected the child pid
+ * and its callback, if it has one, returned. A child which is not
+ * supervised (any more) is waited for with waitpid().
+ * Returns -
+ * -1 - Error
+ * else pid, its exit status is stored in status
+ */
+pid_t supervise_wait(pid_t pid, int *status) {
+  child_t *child;
+
+  pthread_mutex_lock(&sup_lock);
+  if (sup_pid != getpid() || (child = find_child(pid)) == NULL) {
+    pthread_mutex_unlock(&sup_lock);
+    return waitpid(pid, status, 0);
+  }
+  child->waiting = 1;
+  while (!child->done || child->cb)
+    pthread_cond_wait(&sup_cond, &sup_lock);
+  remove_child(child);
+  pthread_mutex_unlock(&sup_lock);
+
+  *status = child->status;
+  free(child);
+  return (*status == -1 ? -1 : pid);
+}
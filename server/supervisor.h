@@ -0,0 +1,29 @@
+/*
+ *  Printer Application Framework.
+ *
+ *  Supervisor of the child processes of the server.
+ *
+ *  Copyright 2019 by Dheeraj.
+ *
+ *  Licensed under Apache License v2.0.  See the file "LICENSE" for more
+ *  information.
+ */
+
+#ifndef PAF_SUPERVISOR_H
+
+#define PAF_SUPERVISOR_H 1
+
+#include <sys/types.h>
+
+#define KILL_TIMEOUT 5     /* Seconds between the signals past a deadline */
+
+/* Called by the supervisor thread when a child was collected */
+typedef void (*supervise_cb_t)(pid_t pid, int status, void *data);
+
+int supervise(pid_t pid, const char *name, int timeout, supervise_cb_t cb,
+	      void *data);
+int supervise_kill(pid_t pid, int sig, int timeout);
+pid_t supervise_wait(pid_t pid, int *status);
+int helper_timeout(void);
+
+#endif
@@ -12,7 +12,12 @@
  * Include necessary headers...
  */
 
+#define _GNU_SOURCE			/* pipe2(), environ */
 #include "util.h"
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
 
 #ifdef __APPLE__
 #  include <libgen.h>
@@ -236,84 +241,34 @@ cupsdPipeCommand(int        *pid,	/* O - Process ID or 0 on error */
                  char       **argv,	/* I - Arguments to pass to command */
 		 uid_t      user)	/* I - User to run as or 0 for current */
 {
-  int	fd,				/* Temporary file descriptor */
-	fds[2];				/* Pipe file descriptors */
+  int	fds[2];				/* Pipe file descriptors */
 
 
  /*
   * First create the pipe...
   */
 
-  if (pipe(fds))
+  if (pipe2(fds, O_CLOEXEC))
   {
     *pid = 0;
     return (NULL);
   }
 
- /*
-  * Set the "close on exec" flag on each end of the pipe...
-  */
-
-  if (fcntl(fds[0], F_SETFD, fcntl(fds[0], F_GETFD) | FD_CLOEXEC))
-  {
-    close(fds[0]);
-    close(fds[1]);
-
-    *pid = 0;
-
-    return (NULL);
-  }
-
-  if (fcntl(fds[1], F_SETFD, fcntl(fds[1], F_GETFD) | FD_CLOEXEC))
-  {
-    close(fds[0]);
-    close(fds[1]);
-
-    *pid = 0;
-
-    return (NULL);
-  }
-
  /*
   * Then run the command...
   */
 
-  if ((*pid = fork()) < 0)
+  if ((*pid = cupsdSpawn(command, argv, NULL, fds[1], -1, -1, 0)) < 0)
   {
-   /*
-    * Unable to fork!
-    */
-
     *pid = 0;
     close(fds[0]);
     close(fds[1]);
 
     return (NULL);
   }
-  else if (!*pid)
-  {
-   /*
-    * Child comes here...
-    */
-
-    /*if (!getuid() && user)
-      setuid(user);*/			/* Run as restricted user */
-
-    if ((fd = open("/dev/null", O_RDONLY)) > 0)
-    {
-      dup2(fd, 0);			/* </dev/null */
-      close(fd);
-    }
-
-    dup2(fds[1], 1);			/* >pipe */
-    close(fds[1]);
-
-    cupsdExec(command, argv);
-    exit(errno);
-  }
 
  /*
-  * Parent comes here, open the input side of the pipe...
+  * Open the input side of the pipe...
   */
 
   close(fds[1]);
@@ -526,88 +481,269 @@ cupsdExec2(const char *command,		/* I - Full path to program */
 
 
 /*
- * 'cupsdPipeCommand2()' - Read output from a command.
+ * 'cupsdSpawnEnv()' - Make the environment of a child: ours, with the
+ *                     "NAME=value" strings of vars (NULL terminated) added
+ *                     or replacing ours. free() the result.
+ *
+ * The environment of the server is not changed after startup, children
+ * get theirs from here instead of setenv() before fork(), which is not
+ * thread-safe.
  */
 
-cups_file_t *				/* O - CUPS file or NULL on error */
-cupsdPipeCommand2(int        *pid,	/* O - Process ID or 0 on error */
-                 const char *command,	/* I - Command to run */
-                 char       **argv,	/* I - Arguments to pass to command */
-                 cups_file_t **errlog,  /* O- cups file for stderr */
-		 uid_t      user)	/* I - User to run as or 0 for current */
+char **					/* O - Environment or NULL on error */
+cupsdSpawnEnv(const char **vars)	/* I - Variables to set */
 {
-  int	fd,				/* Temporary file descriptor */
-	fds[2],				/* Pipe file descriptors */
-  erfd[2];      /* Error Logging FD      */
+  int		i, j,			/* Looping vars */
+		count, num_vars;	/* Number of variables */
+  size_t	len = 0;		/* Bytes for the strings */
+  const char	*eq;			/* End of a name */
+  char		**envp,			/* New environment */
+		*ptr;			/* Next string */
 
- /*
-  * First create the pipe...
-  */
 
-  if (pipe(fds))
-  {
-    *pid = 0;
+  for (num_vars = 0; vars[num_vars]; num_vars ++)
+    len += strlen(vars[num_vars]) + 1;
+  for (count = 0; environ[count]; count ++);
+
+  if ((envp = malloc((count + num_vars + 1) * sizeof(char *) + len)) == NULL)
     return (NULL);
+  ptr = (char *)(envp + count + num_vars + 1);
+
+  for (i = 0, count = 0; environ[i]; i ++)
+  {
+    if ((eq = strchr(environ[i], '=')) == NULL)
+      continue;
+    for (j = 0; j < num_vars; j ++)
+      if (!strncmp(vars[j], environ[i], eq - environ[i] + 1))
+	break;
+    if (j == num_vars)
+      envp[count ++] = environ[i];
   }
-  if(pipe(erfd))
+  for (j = 0; j < num_vars; j ++)
   {
-    *pid = 0;
-    return (NULL);
+    strcpy(ptr, vars[j]);
+    envp[count ++] = ptr;
+    ptr += strlen(ptr) + 1;
+  }
+  envp[count] = NULL;
+
+  return (envp);
+}
+
+
+/*
+ * 'cupsdSpawn()' - Start a command with its stdin on /dev/null and its
+ *                  stdout and stderr on out_fd and err_fd (-1 for ours).
+ *
+ * posix_spawn() neither copies the address space of the server nor runs
+ * any code in the child which could take a lock held by another thread,
+ * so this is cheap and safe from any thread. PR_SET_PDEATHSIG cannot be
+ * set through posix_spawn(), so CUPSD_SPAWN_PDEATHSIG children are made
+ * with vfork() and only make system calls before execve().
+ *
+ * The death signal is sent when the thread which forked the child exits,
+ * not the process, so CUPSD_SPAWN_PDEATHSIG is only accepted from the
+ * main thread; from any other thread cupsdSpawn() fails with EINVAL.
+ *
+ * CUPSD_SPAWN_PGROUP children lead a process group of their own, so that
+ * they can be killed together with the programs they started.
+ *
+ * A listen_fd is passed the systemd way, as fd 3 with LISTEN_FDS=1 and
+ * LISTEN_PID set to the pid of the command; only the child knows that,
+ * so this also needs vfork().
+ */
+
+pid_t					/* O - Process ID or -1 on error */
+cupsdSpawn(const char *command,		/* I - Full path to program */
+	   char       **argv,		/* I - Command-line arguments */
+	   char       **envp,		/* I - Environment or NULL for ours */
+	   int        out_fd,		/* I - stdout of the command or -1 */
+	   int        err_fd,		/* I - stderr of the command or -1 */
+	   int        listen_fd,	/* I - Socket to pass or -1 */
+	   int        flags)		/* I - CUPSD_SPAWN_* */
+{
+  pid_t				pid,	/* Child process ID */
+				parent;	/* Our process ID */
+  int				i, j,	/* Looping vars */
+				sig,	/* Signal number */
+				err;	/* posix_spawn() error */
+  char				listen_pid[32],
+					/* LISTEN_PID of the child */
+				**listen_envp = NULL,
+					/* envp with LISTEN_FDS and _PID */
+				*ptr;	/* Pointer into listen_pid */
+  sigset_t			mask,	/* Signal mask of the command */
+				all,	/* All signals */
+				old;	/* Signal mask of this thread */
+  struct sigaction		action;	/* Signal action in the child */
+  posix_spawnattr_t		attr;	/* Attributes */
+  posix_spawn_file_actions_t	actions;/* File descriptor actions */
+
+
+  if ((flags & CUPSD_SPAWN_PDEATHSIG) && syscall(SYS_gettid) != getpid())
+  {
+    errno = EINVAL;			/* Would die with this thread */
+    return (-1);
   }
+
+  if (!envp)
+    envp = environ;
+  sigemptyset(&mask);			/* deviced blocks SIGCHLD */
+
+  if (!(flags & CUPSD_SPAWN_PDEATHSIG) && listen_fd < 0)
+  {
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+			     ((flags & CUPSD_SPAWN_PGROUP) ?
+			      POSIX_SPAWN_SETPGROUP : 0));
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    if (out_fd >= 0)
+      posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+    if (err_fd >= 0)
+      posix_spawn_file_actions_adddup2(&actions, err_fd, 2);
+
+    err = posix_spawn(&pid, command, &actions, &attr, argv, envp);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err)
+    {
+      errno = err;
+      return (-1);
+    }
+    return (pid);
+  }
+
  /*
-  * Set the "close on exec" flag on each end of the pipe...
+  * The child only fills in its pid, LISTEN_PID has to be in the
+  * environment already...
   */
 
-  if (fcntl(fds[0], F_SETFD, fcntl(fds[0], F_GETFD) | FD_CLOEXEC))
+  if (listen_fd >= 0)
   {
-    close(fds[0]);
-    close(fds[1]);
+    for (i = 0; envp[i]; i ++);
+    if ((listen_envp = malloc((i + 3) * sizeof(char *))) == NULL)
+      return (-1);
+    for (i = 0, j = 0; envp[i]; i ++)
+      if (strncmp(envp[i], "LISTEN_", 7))
+	listen_envp[j ++] = envp[i];
+    strlcpy(listen_pid, "LISTEN_PID=", sizeof(listen_pid));
+    listen_envp[j ++] = (char *)"LISTEN_FDS=1";
+    listen_envp[j ++] = listen_pid;
+    listen_envp[j]    = NULL;
+    envp = listen_envp;
+  }
 
-    *pid = 0;
+ /*
+  * The vfork() child shares our memory, so no signal handler may run in
+  * it: block everything until the child has reset its handlers...
+  */
 
-    return (NULL);
-  }
+  parent = getpid();
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
 
-  if (fcntl(fds[1], F_SETFD, fcntl(fds[1], F_GETFD) | FD_CLOEXEC))
+  if ((pid = vfork()) == 0)
   {
-    close(fds[0]);
-    close(fds[1]);
+    for (sig = 1; sig < NSIG; sig ++)
+      if (!sigaction(sig, NULL, &action) && action.sa_handler != SIG_DFL &&
+	  action.sa_handler != SIG_IGN)
+      {
+	action.sa_handler = SIG_DFL;
+	sigaction(sig, &action, NULL);
+      }
 
-    *pid = 0;
+    if ((flags & CUPSD_SPAWN_PDEATHSIG) &&
+        (prctl(PR_SET_PDEATHSIG, SIGTERM) || getppid() != parent))
+      _exit(1);				/* The parent is gone already */
+    if (flags & CUPSD_SPAWN_PGROUP)
+      setpgid(0, 0);
 
-    return (NULL);
+    if ((sig = open("/dev/null", O_RDONLY)) > 0)
+    {
+      dup2(sig, 0);			/* </dev/null */
+      close(sig);
+    }
+    if (out_fd >= 0)
+      dup2(out_fd, 1);
+    if (err_fd >= 0)
+      dup2(err_fd, 2);
+    if (listen_fd == 3)
+      fcntl(3, F_SETFD, 0);		/* Keep it open */
+    else if (listen_fd >= 0)
+      dup2(listen_fd, 3);
+
+    if (listen_fd >= 0)
+    {
+      ptr  = listen_pid + sizeof(listen_pid) - 1;
+      *ptr = '\0';
+      for (i = getpid(); i > 0; i /= 10)
+	*--ptr = '0' + i % 10;
+      memmove(listen_pid + 11, ptr, strlen(ptr) + 1);
+    }
+
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    execve(command, argv, envp);
+    _exit(127);
   }
 
-    if (fcntl(erfd[0], F_SETFD, fcntl(erfd[0], F_GETFD) | FD_CLOEXEC))
-  {
-    close(erfd[0]);
-    close(erfd[1]);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  free(listen_envp);
 
-    *pid = 0;
+  return (pid < 0 ? -1 : pid);
+}
+
+
+/*
+ * 'cupsdPipeCommand2()' - Read output and errors of a command.
+ */
+
+cups_file_t *				/* O - CUPS file or NULL on error */
+cupsdPipeCommand2(int        *pid,	/* O - Process ID or 0 on error */
+                 const char *command,	/* I - Command to run */
+                 char       **argv,	/* I - Arguments to pass to command */
+                 char       **envp,	/* I - Environment or NULL for ours */
+                 cups_file_t **errlog,  /* O- cups file for stderr */
+		 uid_t      user)	/* I - User to run as or 0 for current */
+{
+  int	fds[2],				/* Pipe file descriptors */
+  erfd[2];      /* Error Logging FD      */
+
+  if (errlog)
+    *errlog = NULL;
 
+ /*
+  * First create the pipes, "close on exec" right away as the server runs
+  * commands from several threads and other children must not inherit
+  * them...
+  */
+
+  if (pipe2(fds, O_CLOEXEC))
+  {
+    *pid = 0;
     return (NULL);
   }
-
-  if (fcntl(erfd[1], F_SETFD, fcntl(erfd[1], F_GETFD) | FD_CLOEXEC))
+  if (pipe2(erfd, O_CLOEXEC))
   {
-    close(erfd[0]);
-    close(erfd[1]);
+    close(fds[0]);
+    close(fds[1]);
 
     *pid = 0;
-
     return (NULL);
   }
 
  /*
-  * Then run the command...
+  * Then run the command, in its own process group so that a hung command
+  * can be killed with everything it started...
   */
 
-  if ((*pid = fork()) < 0)
+  if ((*pid = cupsdSpawn(command, argv, envp, fds[1], erfd[1], -1,
+			 CUPSD_SPAWN_PGROUP)) < 0)
   {
-   /*
-    * Unable to fork!
-    */
-
     *pid = 0;
     close(fds[0]);
     close(fds[1]);
@@ -616,33 +752,9 @@ cupsdPipeCommand2(int        *pid,	/* O - Process ID or 0 on error */
 
     return (NULL);
   }
-  else if (!*pid)
-  {
-   /*
-    * Child comes here...
-    */
-
-    /*if (!getuid() && user)
-      setuid(user);*/			/* Run as restricted user */
-
-    if ((fd = open("/dev/null", O_RDONLY)) > 0)
-    {
-      dup2(fd, 0);			/* </dev/null */
-      close(fd);
-    }
-
-    dup2(erfd[1],2);      /* 2> err */
-    close(erfd[1]);
-
-    dup2(fds[1], 1);			/* >pipe */
-    close(fds[1]);
-
-    cupsdExec(command, argv);
-    exit(errno);
-  }
 
  /*
-  * Parent comes here, open the input side of the pipe...
+  * Open the input sides of the pipes...
   */
   close(erfd[1]);
   close(fds[1]);
@@ -683,6 +795,45 @@ strlcpy(char       *dst,		/* O - Destination string */
   return (srclen);
 }
 
+size_t					/* O - Length of string */
+strlcat(char       *dst,		/* O - Destination string */
+	const char *src,		/* I - Source string */
+	size_t     size)		/* I - Size of destination string buffer */
+{
+  size_t	srclen;			/* Length of source string */
+  size_t	dstlen;			/* Length of destination string */
+
+
+ /*
+  * Figure out how much room is left...
+  */
+
+  dstlen = strlen(dst);
+
+  if (size < (dstlen + 1))
+    return (dstlen);		/* No room, return immediately... */
+
+  size -= dstlen + 1;
+
+ /*
+  * Figure out how much room is needed...
+  */
+
+  srclen = strlen(src);
+
+ /*
+  * Copy the appropriate amount...
+  */
+
+  if (srclen > size)
+    srclen = size;
+
+  memmove(dst + dstlen, src, srclen);
+  dst[dstlen + srclen] = '\0';
+
+  return (dstlen + srclen);
+}
+
 #if 0
 /*
  * '_cups_strcpy()' - Copy a string allowing for overlapping strings.
@@ -743,3 +894,20 @@ int fileCheck(char *filename)
   }
   return 1;
 }
+
+/*
+ * getenv_int() - Integer value of an environment variable, or def if it is
+ * unset or not a number.
+ */
+int getenv_int(const char *name, int def)
+{
+  char *p, *end;
+  long val;
+
+  if ((p = getenv(name)) == NULL || !*p)
+    return def;
+  val = strtol(p, &end, 10);
+  if (*end)
+    return def;
+  return (int)val;
+}
@@ -43,6 +43,10 @@ extern "C" {
 
 typedef int (*cupsd_compare_func_t)(const void *, const void *);
 
+#define CUPSD_SPAWN_PDEATHSIG 1		/* SIGTERM the child when we exit,
+					   main thread only */
+#define CUPSD_SPAWN_PGROUP 2		/* Start a new process group */
+
 
 /*
  * Prototypes...
@@ -63,14 +67,21 @@ extern void		cupsdSendIPPString(ipp_tag_t value_tag,
 extern void		cupsdSendIPPTrailer(void);
 
 extern cups_file_t *cupsdPipeCommand2(int *pid, const char *command,
-								char **argv,cups_file_t **errlog, uid_t user);
+			char **argv, char **envp, cups_file_t **errlog,
+			uid_t user);
+extern char		**cupsdSpawnEnv(const char **vars);
+extern pid_t		cupsdSpawn(const char *command, char **argv,
+			           char **envp, int out_fd, int err_fd,
+			           int listen_fd, int flags);
 
 extern int		cupsdExec2(const char* command, char **argv, char **env);
 
 extern size_t strlcpy(char *dst,const char *src,size_t size);
+extern size_t strlcat(char *dst,const char *src,size_t size);
 void _cups_strcpy(char *dst,const char *src);
 char *strrev(char *str);
 int fileCheck(char *filename);
+int getenv_int(const char *name, int def);
 
 #  ifdef __cplusplus
 }